@@ -0,0 +1,285 @@
+#ifndef ASYNCLOGGER_H
+#define ASYNCLOGGER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * What a thread logging into a full buffer does.
+ * - Drop: the record is dropped and counted, the thread never waits
+ * - Block: the thread waits for the flusher to make room
+ */
+enum class LogOverflow { Drop, Block };
+
+/**
+ * Asynchronous log backend. Every thread appends its preformatted records to
+ * its own single producer ring, which only costs a copy and a release store,
+ * and a background flusher drains the rings into large write() calls. The
+ * records of a thread stay in order, the ones of different threads are only
+ * interleaved at record boundaries.
+ *
+ * The flusher is only started by the first record, a program that never logs
+ * through it pays nothing.
+ */
+class AsyncLogger
+{
+public:
+    // The size of the ring of each thread, a power of two
+    static constexpr size_t bufferSize = 1 << 16;
+
+    static AsyncLogger &instance()
+    {
+        static AsyncLogger logger;
+        return logger;
+    }
+
+    /* Sets the file descriptor the records are written to, stdout by default. */
+    void setOutput(int fd) { output.store(fd, std::memory_order_relaxed); }
+
+    void setOverflow(LogOverflow mode) { overflow.store(mode, std::memory_order_relaxed); }
+
+    /* Returns the number of records dropped because a ring was full. */
+    uint64_t dropped() const { return nbDropped.load(std::memory_order_relaxed); }
+
+    /**
+     * Queues a record as is, it is expected to end with a newline. Records
+     * longer than the ring are truncated.
+     */
+    void log(std::string_view record)
+    {
+        Buffer &buffer = threadBuffer();
+        size_t length = std::min(record.size(), bufferSize);
+        uint64_t tail = buffer.tail.load(std::memory_order_relaxed);
+        while (tail + length - buffer.head.load(std::memory_order_acquire) > bufferSize) {
+            if (overflow.load(std::memory_order_relaxed) == LogOverflow::Drop) {
+                nbDropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            wakeFlusher();
+            std::this_thread::yield();
+        }
+
+        size_t offset = tail & (bufferSize - 1);
+        size_t first = std::min(length, bufferSize - offset);
+        std::memcpy(buffer.data.get() + offset, record.data(), first);
+        std::memcpy(buffer.data.get(), record.data() + first, length - first);
+        buffer.tail.store(tail + length, std::memory_order_release);
+    }
+
+    /**
+     * Blocks until every record logged before the call, by any thread, is
+     * written. Does nothing if nothing was ever logged.
+     */
+    void flush()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!flusher.joinable()) {
+            return;
+        }
+        uint64_t target = ++requested;
+        cond.notify_all();
+        flushedCond.wait(lock, [this, target] { return completed >= target; });
+    }
+
+private:
+    struct Buffer
+    {
+        std::unique_ptr<char[]> data = std::make_unique<char[]>(bufferSize);
+        // Only written by the flusher
+        std::atomic<uint64_t> head{0};
+        // Only written by the owning thread
+        std::atomic<uint64_t> tail{0};
+        // Set once the owning thread exited, the flusher then drops the buffer
+        std::atomic<bool> orphaned{false};
+    };
+
+    /**
+     * Hands the buffer over to the flusher when the thread exits.
+     */
+    struct Owner
+    {
+        std::shared_ptr<Buffer> buffer;
+
+        ~Owner()
+        {
+            if (buffer) {
+                buffer->orphaned.store(true, std::memory_order_release);
+            }
+        }
+    };
+
+    // How long the flusher sleeps when the rings are empty
+    static constexpr std::chrono::milliseconds flushInterval{5};
+    // The size above which the flusher writes what it gathered so far
+    static constexpr size_t batchSize = 1 << 16;
+
+    std::atomic<int> output{STDOUT_FILENO};
+    std::atomic<LogOverflow> overflow{LogOverflow::Block};
+    std::atomic<uint64_t> nbDropped{0};
+
+    // Guards everything below
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::condition_variable flushedCond;
+    std::vector<std::shared_ptr<Buffer>> buffers;
+    // The flush() calls made and the ones the flusher went through
+    uint64_t requested = 0;
+    uint64_t completed = 0;
+    bool stopping = false;
+    std::thread flusher;
+
+    AsyncLogger() = default;
+
+    ~AsyncLogger()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!flusher.joinable()) {
+                return;
+            }
+            stopping = true;
+        }
+        cond.notify_all();
+        flusher.join();
+    }
+
+    Buffer &threadBuffer()
+    {
+        static thread_local Owner owner;
+        if (!owner.buffer) {
+            owner.buffer = std::make_shared<Buffer>();
+            std::lock_guard<std::mutex> lock(mutex);
+            buffers.push_back(owner.buffer);
+            if (!flusher.joinable()) {
+                flusher = std::thread(&AsyncLogger::flushLoop, this);
+            }
+        }
+        return *owner.buffer;
+    }
+
+    void wakeFlusher()
+    {
+        { std::lock_guard<std::mutex> lock(mutex); }
+        cond.notify_all();
+    }
+
+    void flushLoop()
+    {
+        std::string batch;
+        batch.reserve(2 * batchSize);
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            uint64_t target = requested;
+            bool stop = stopping;
+            std::vector<std::shared_ptr<Buffer>> drained = buffers;
+            lock.unlock();
+
+            // NOTE: the orphaned flag is read before draining, a buffer seen
+            // orphaned is then empty once drained
+            std::vector<Buffer *> finished;
+            for (const auto &buffer : drained) {
+                bool orphaned = buffer->orphaned.load(std::memory_order_acquire);
+                drain(*buffer, batch);
+                if (orphaned) {
+                    finished.push_back(buffer.get());
+                }
+            }
+            write(batch);
+
+            lock.lock();
+            if (!finished.empty()) {
+                buffers.erase(std::remove_if(buffers.begin(), buffers.end(),
+                                             [&finished](const auto &buffer) {
+                                                 return std::find(finished.begin(), finished.end(),
+                                                                  buffer.get())
+                                                        != finished.end();
+                                             }),
+                              buffers.end());
+            }
+            if (target > completed) {
+                completed = target;
+                flushedCond.notify_all();
+            }
+            if (stop) {
+                return;
+            }
+            cond.wait_for(lock, flushInterval, [this, target] {
+                return stopping || requested > target;
+            });
+        }
+    }
+
+    void drain(Buffer &buffer, std::string &batch)
+    {
+        uint64_t head = buffer.head.load(std::memory_order_relaxed);
+        uint64_t tail = buffer.tail.load(std::memory_order_acquire);
+        while (head < tail) {
+            size_t offset = head & (bufferSize - 1);
+            size_t length = std::min<uint64_t>(tail - head, bufferSize - offset);
+            batch.append(buffer.data.get() + offset, length);
+            head += length;
+            if (batch.size() >= batchSize) {
+                // NOTE: releases the room before the write() so that a
+                // blocked producer can go on meanwhile
+                buffer.head.store(head, std::memory_order_release);
+                write(batch);
+            }
+        }
+        buffer.head.store(head, std::memory_order_release);
+    }
+
+    void write(std::string &batch)
+    {
+        int fd = output.load(std::memory_order_relaxed);
+        size_t written = 0;
+        while (written < batch.size()) {
+            ssize_t nb = ::write(fd, batch.data() + written, batch.size() - written);
+            if (nb <= 0) {
+                break;
+            }
+            written += nb;
+        }
+        batch.clear();
+    }
+};
+
+/**
+ * Formats a record with operator<<, like PcoLogger, and hands it over to the
+ * AsyncLogger once the statement ends.
+ *
+ *     AsyncLog() << "[worker" << id << "] done" << std::endl;
+ */
+class AsyncLog
+{
+public:
+    template<typename T>
+    AsyncLog &operator<<(const T &value)
+    {
+        stream << value;
+        return *this;
+    }
+
+    AsyncLog &operator<<(std::ostream &(*manipulator)(std::ostream &))
+    {
+        stream << manipulator;
+        return *this;
+    }
+
+    ~AsyncLog() { AsyncLogger::instance().log(stream.str()); }
+
+private:
+    std::ostringstream stream;
+};
+
+#endif // ASYNCLOGGER_H
@@ -0,0 +1,262 @@
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <pcosynchro/pcothread.h>
+
+#include "threadpool.h"
+
+///
+/// Microbenchmarks of the scheduling overhead of the ThreadPool. The tasks do
+/// nothing (or wait on a flag) so that only the pool is measured.
+///
+/// Results are written as JSON to threadpool_bench.json unless --benchmark_out
+/// is given, so that runs can be compared with benchmark's compare.py.
+///
+
+typedef std::chrono::steady_clock Clock;
+
+///
+/// \brief The EmptyRunnable class
+/// A Runnable doing nothing, optionally recording when it started
+class EmptyRunnable : public Runnable
+{
+    //! Where to store the time at which run() was called, if anywhere
+    std::atomic<Clock::rep> *m_startedAt;
+
+public:
+    explicit EmptyRunnable(std::atomic<Clock::rep> *startedAt = nullptr) : m_startedAt(startedAt) {
+    }
+
+    void run() override {
+        if (m_startedAt) {
+            m_startedAt->store(Clock::now().time_since_epoch().count());
+        }
+    }
+
+    void cancelRun() override {
+    }
+
+    std::string id() override {
+        return "empty";
+    }
+};
+
+///
+/// \brief The BlockingRunnable class
+/// A Runnable occupying its worker until the given flag is set
+class BlockingRunnable : public Runnable
+{
+    //! Released by the benchmark once it is done
+    const std::atomic<bool> *m_release;
+
+public:
+    explicit BlockingRunnable(const std::atomic<bool> *release) : m_release(release) {
+    }
+
+    void run() override {
+        while (!m_release->load()) {
+            PcoThread::usleep(100);
+        }
+    }
+
+    void cancelRun() override {
+    }
+
+    std::string id() override {
+        return "blocking";
+    }
+};
+
+///
+/// \brief Occupies every worker of a pool with a BlockingRunnable
+///
+static void saturate(ThreadPool &pool, int nbWorkers, const std::atomic<bool> &release)
+{
+    for (int i = 0; i < nbWorkers; i++) {
+        pool.start(std::make_unique<BlockingRunnable>(&release));
+    }
+    while (pool.activeCount() < static_cast<size_t>(nbWorkers)) {
+        std::this_thread::yield();
+    }
+}
+
+///
+/// \brief Empty tasks per second, args are the number of producers and workers
+///
+static void BM_EmptyTaskThroughput(benchmark::State &state)
+{
+    const int nbProducers = state.range(0);
+    const int nbWorkers = state.range(1);
+    const int nbTasks = 10000;
+    ThreadPool pool(nbWorkers, nbProducers * nbTasks, std::chrono::milliseconds{1000});
+
+    for (auto _ : state) {
+        std::vector<std::thread> producers;
+        for (int p = 0; p < nbProducers; p++) {
+            producers.emplace_back([&pool]() {
+                for (int i = 0; i < nbTasks; i++) {
+                    pool.start(std::make_unique<EmptyRunnable>());
+                }
+            });
+        }
+        for (auto &producer : producers) {
+            producer.join();
+        }
+        pool.waitForDone();
+    }
+
+    state.SetItemsProcessed(state.iterations() * nbProducers * nbTasks);
+}
+BENCHMARK(BM_EmptyTaskThroughput)
+    ->ArgNames({"producers", "workers"})
+    ->ArgsProduct({{1, 2, 4}, {1, 2, 4, 8}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+///
+/// \brief Latency of start() when the pool has an idle worker to wake up
+///
+static void BM_StartLatencyIdle(benchmark::State &state)
+{
+    ThreadPool pool(1, 16, std::chrono::milliseconds{1000});
+
+    for (auto _ : state) {
+        auto runnable = std::make_unique<EmptyRunnable>();
+        auto begin = Clock::now();
+        pool.start(std::move(runnable));
+        auto end = Clock::now();
+        state.SetIterationTime(std::chrono::duration<double>(end - begin).count());
+        pool.waitForDone();
+    }
+}
+BENCHMARK(BM_StartLatencyIdle)->UseManualTime()->Unit(benchmark::kNanosecond);
+
+///
+/// \brief Latency of start() when every worker is busy and the task is queued
+///
+static void BM_StartLatencySaturated(benchmark::State &state)
+{
+    const int nbWorkers = state.range(0);
+    const int nbIterations = 100000;
+    std::atomic<bool> release{false};
+    ThreadPool pool(nbWorkers, nbIterations, std::chrono::milliseconds{1000});
+    saturate(pool, nbWorkers, release);
+
+    for (auto _ : state) {
+        auto runnable = std::make_unique<EmptyRunnable>();
+        auto begin = Clock::now();
+        pool.start(std::move(runnable));
+        auto end = Clock::now();
+        state.SetIterationTime(std::chrono::duration<double>(end - begin).count());
+    }
+
+    // NOTE: shutdown() joins the workers, which have to be released first
+    release = true;
+    pool.shutdown(ShutdownMode::CancelPending);
+}
+BENCHMARK(BM_StartLatencySaturated)
+    ->ArgNames({"workers"})
+    ->Arg(1)
+    ->Arg(4)
+    ->Iterations(100000)
+    ->UseManualTime()
+    ->Unit(benchmark::kNanosecond);
+
+///
+/// \brief Time between start() and run() for a worker waiting for a task
+///
+static void BM_WakeToRunLatency(benchmark::State &state)
+{
+    ThreadPool pool(1, 16, std::chrono::milliseconds{1000});
+    std::atomic<Clock::rep> startedAt{0};
+
+    for (auto _ : state) {
+        // NOTE: lets the worker go back to waiting on its condition
+        pool.waitForDone();
+        std::this_thread::sleep_for(std::chrono::microseconds{200});
+
+        auto runnable = std::make_unique<EmptyRunnable>(&startedAt);
+        auto begin = Clock::now();
+        pool.start(std::move(runnable));
+        pool.waitForDone();
+        state.SetIterationTime(
+            std::chrono::duration<double>(Clock::duration(startedAt.load()) - begin.time_since_epoch())
+                .count());
+    }
+}
+BENCHMARK(BM_WakeToRunLatency)->UseManualTime()->Unit(benchmark::kMicrosecond);
+
+///
+/// \brief Cost of start() refusing a task because the queue is full
+///
+static void BM_RejectWhenFull(benchmark::State &state)
+{
+    const int nbWaiting = 16;
+    std::atomic<bool> release{false};
+    ThreadPool pool(1, nbWaiting, std::chrono::milliseconds{1000});
+    saturate(pool, 1, release);
+    for (int i = 0; i < nbWaiting; i++) {
+        pool.start(std::make_unique<EmptyRunnable>());
+    }
+
+    for (auto _ : state) {
+        auto runnable = std::make_unique<EmptyRunnable>();
+        auto begin = Clock::now();
+        bool accepted = pool.start(std::move(runnable));
+        auto end = Clock::now();
+        benchmark::DoNotOptimize(accepted);
+        state.SetIterationTime(std::chrono::duration<double>(end - begin).count());
+    }
+
+    // NOTE: shutdown() joins the workers, which have to be released first
+    release = true;
+    pool.shutdown(ShutdownMode::CancelPending);
+}
+BENCHMARK(BM_RejectWhenFull)->UseManualTime()->Unit(benchmark::kNanosecond);
+
+///
+/// \brief A worker spawned for a task, timed out and retired, over and over
+///
+static void BM_SpawnTimeoutChurn(benchmark::State &state)
+{
+    ThreadPool pool(1, 16, std::chrono::milliseconds{1});
+
+    for (auto _ : state) {
+        pool.start(std::make_unique<EmptyRunnable>());
+        pool.waitForDone();
+        while (pool.currentNbThreads() > 0) {
+            std::this_thread::yield();
+        }
+    }
+}
+BENCHMARK(BM_SpawnTimeoutChurn)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+
+int main(int argc, char **argv) {
+    // Writes the results as JSON unless told otherwise
+    std::vector<char *> args(argv, argv + argc);
+    std::string out = "--benchmark_out=threadpool_bench.json";
+    std::string format = "--benchmark_out_format=json";
+    bool hasOut = false;
+    for (int i = 1; i < argc; i++) {
+        hasOut = hasOut || std::string(argv[i]).rfind("--benchmark_out=", 0) == 0;
+    }
+    if (!hasOut) {
+        args.push_back(out.data());
+        args.push_back(format.data());
+    }
+    int nbArgs = args.size();
+
+    benchmark::Initialize(&nbArgs, args.data());
+    if (benchmark::ReportUnrecognizedArguments(nbArgs, args.data())) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,142 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Log-bucketed histogram of non negative values, HDR style. Values below 8 have
+ * their own bucket, the other ones are bucketed by their highest bit with 8
+ * linear sub-buckets per power of two, which keeps the relative error under
+ * 12.5% over the whole uint64_t range with a fixed number of buckets.
+ */
+class Histogram
+{
+public:
+    static constexpr size_t nbSubBits = 3;
+    static constexpr size_t nbSub = 1 << nbSubBits;
+    static constexpr size_t nbBuckets = (64 - nbSubBits + 1) * nbSub;
+
+    static size_t bucketOf(uint64_t value)
+    {
+        if (value < nbSub) {
+            return value;
+        }
+        size_t msb = 63 - __builtin_clzll(value);
+        size_t sub = (value >> (msb - nbSubBits)) & (nbSub - 1);
+        return (msb - nbSubBits + 1) * nbSub + sub;
+    }
+
+    /* Returns the smallest value falling in the given bucket. */
+    static uint64_t lowerBound(size_t bucket)
+    {
+        if (bucket < nbSub) {
+            return bucket;
+        }
+        size_t msb = bucket / nbSub + nbSubBits - 1;
+        return (nbSub + bucket % nbSub) << (msb - nbSubBits);
+    }
+
+    /* Returns the largest value falling in the given bucket. */
+    static uint64_t upperBound(size_t bucket)
+    {
+        return bucket + 1 < nbBuckets ? lowerBound(bucket + 1) - 1 : UINT64_MAX;
+    }
+
+    void record(uint64_t value, uint64_t count = 1)
+    {
+        counts[bucketOf(value)] += count;
+        total += count;
+        sum += value * count;
+    }
+
+    void merge(const Histogram &other)
+    {
+        for (size_t i = 0; i < nbBuckets; ++i) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        sum += other.sum;
+    }
+
+    uint64_t count() const { return total; }
+
+    uint64_t mean() const { return total ? sum / total : 0; }
+
+    /* Returns the sum of the recorded values, exact unlike mean() * count(). */
+    uint64_t valueSum() const { return sum; }
+
+    uint64_t bucketCount(size_t bucket) const { return counts[bucket]; }
+
+    /**
+     * Returns an upper bound of the value below which the given fraction
+     * (between 0 and 1) of the recorded values fall, 0 if nothing was recorded.
+     */
+    uint64_t percentile(double fraction) const
+    {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(fraction * total);
+        if (rank >= total) {
+            rank = total - 1;
+        }
+        uint64_t seen = 0;
+        for (size_t i = 0; i < nbBuckets; ++i) {
+            seen += counts[i];
+            if (seen > rank) {
+                return upperBound(i);
+            }
+        }
+        return upperBound(nbBuckets - 1);
+    }
+
+    /* Returns an upper bound of the largest recorded value. */
+    uint64_t max() const { return percentile(1.0); }
+
+private:
+    friend class AtomicHistogram;
+
+    std::array<uint64_t, nbBuckets> counts{};
+    uint64_t total = 0;
+    uint64_t sum = 0;
+};
+
+/**
+ * Same buckets as Histogram but recordable concurrently with relaxed atomics,
+ * meant to be written on a hot path and read through snapshot() once in a
+ * while. The snapshot isn't a consistent cut, each bucket is.
+ */
+class AtomicHistogram
+{
+public:
+    void record(uint64_t value)
+    {
+        counts[Histogram::bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    Histogram snapshot() const
+    {
+        Histogram histogram;
+        mergeInto(histogram);
+        return histogram;
+    }
+
+    void mergeInto(Histogram &histogram) const
+    {
+        for (size_t i = 0; i < Histogram::nbBuckets; ++i) {
+            uint64_t count = counts[i].load(std::memory_order_relaxed);
+            histogram.counts[i] += count;
+            histogram.total += count;
+        }
+        histogram.sum += sum.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, Histogram::nbBuckets> counts{};
+    std::atomic<uint64_t> sum{0};
+};
+
+#endif // HISTOGRAM_H
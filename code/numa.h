@@ -0,0 +1,209 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <dirent.h>
+#include <fstream>
+#include <numeric>
+#include <sched.h>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * The NUMA nodes of the machine and the CPUs of theirs that the process may
+ * run on, as listed under /sys/devices/system/node and allowed by its
+ * affinity mask when detected. Reading sysfs spares a dependency on libnuma.
+ * Nodes are numbered from 0 in the order of their sysfs ids. Without sysfs,
+ * the machine is a single node holding every allowed CPU.
+ */
+class NumaTopology
+{
+public:
+    /* Returns the topology of the machine, read once with the affinity mask
+     * the process has then. */
+    static const NumaTopology &system()
+    {
+        static const NumaTopology topology = detect();
+        return topology;
+    }
+
+    /**
+     * Reads the topology from the given sysfs directory, keeping the allowed
+     * CPUs only, every one when allowed is empty.
+     */
+    static NumaTopology detect(
+        const std::string &root = "/sys/devices/system/node",
+        const std::vector<int> &allowed = allowedCpus())
+    {
+        NumaTopology topology;
+        std::vector<int> ids;
+        if (DIR *dir = opendir(root.c_str())) {
+            while (dirent *entry = readdir(dir)) {
+                std::string name = entry->d_name;
+                if (name.size() > 4 && name.compare(0, 4, "node") == 0
+                    && std::all_of(name.begin() + 4, name.end(), ::isdigit)) {
+                    ids.push_back(std::atoi(name.c_str() + 4));
+                }
+            }
+            closedir(dir);
+        }
+        std::sort(ids.begin(), ids.end());
+
+        for (int id : ids) {
+            std::string node = root + "/node" + std::to_string(id);
+            std::vector<int> cpus = parseCpuList(readLine(node + "/cpulist"));
+            if (!allowed.empty()) {
+                cpus.erase(
+                    std::remove_if(
+                        cpus.begin(),
+                        cpus.end(),
+                        [&allowed](int cpu) {
+                            return std::find(allowed.begin(), allowed.end(), cpu) == allowed.end();
+                        }),
+                    cpus.end());
+            }
+            // NOTE: memory only nodes, and the nodes the process may not run
+            // on, have no CPU to run a worker on
+            if (cpus.empty()) {
+                continue;
+            }
+            topology.nodeCpus.push_back(std::move(cpus));
+            std::istringstream distances(readLine(node + "/distance"));
+            std::vector<int> row;
+            for (int distance; distances >> distance;) {
+                row.push_back(distance);
+            }
+            // NOTE: the distances follow the sysfs ids, including the nodes
+            // skipped above, see index()
+            topology.distances.push_back(std::move(row));
+            topology.sysfsIds.push_back(id);
+        }
+
+        if (topology.nodeCpus.empty()) {
+            std::vector<int> cpus = allowed;
+            if (cpus.empty()) {
+                cpus.resize(std::max(1u, std::thread::hardware_concurrency()));
+                std::iota(cpus.begin(), cpus.end(), 0);
+            }
+            topology.nodeCpus.push_back(std::move(cpus));
+            topology.sysfsIds.push_back(0);
+            topology.distances.push_back({});
+        }
+        topology.index(ids);
+        return topology;
+    }
+
+    /* Returns the CPUs of the affinity mask of the calling thread, none
+     * when it can't be read. */
+    static std::vector<int> allowedCpus()
+    {
+        std::vector<int> cpus;
+        cpu_set_t set;
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &set)) {
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+        return cpus;
+    }
+
+    /* Parses a sysfs CPU list such as "0-3,8,10-11". */
+    static std::vector<int> parseCpuList(const std::string &list)
+    {
+        std::vector<int> cpus;
+        std::istringstream stream(list);
+        for (std::string range; std::getline(stream, range, ',');) {
+            if (range.empty() || !::isdigit(static_cast<unsigned char>(range[0]))) {
+                continue;
+            }
+            size_t dash = range.find('-');
+            int first = std::atoi(range.c_str());
+            int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    size_t nodeCount() const { return nodeCpus.size(); }
+
+    const std::vector<int> &cpus(size_t node) const { return nodeCpus[node]; }
+
+    /* Returns every CPU, node by node. */
+    std::vector<int> allCpus() const
+    {
+        std::vector<int> result;
+        for (const auto &cpus : nodeCpus) {
+            result.insert(result.end(), cpus.begin(), cpus.end());
+        }
+        return result;
+    }
+
+    /* Returns the node of a CPU, 0 for an unknown one. */
+    size_t nodeOf(int cpu) const
+    {
+        return cpu >= 0 && static_cast<size_t>(cpu) < cpuNodes.size() ? cpuNodes[cpu] : 0;
+    }
+
+    /* Returns the node the calling thread currently runs on. */
+    size_t currentNode() const { return nodeCount() > 1 ? nodeOf(sched_getcpu()) : 0; }
+
+    /* Returns every node, the given one first and then the nearest ones. */
+    const std::vector<size_t> &nearest(size_t node) const { return byDistance[node]; }
+
+private:
+    std::vector<std::vector<int>> nodeCpus;
+    // The sysfs id of each node
+    std::vector<int> sysfsIds;
+    // The distance of each node to each sysfs id
+    std::vector<std::vector<int>> distances;
+    std::vector<size_t> cpuNodes;
+    std::vector<std::vector<size_t>> byDistance;
+
+    void index(const std::vector<int> &ids)
+    {
+        for (size_t node = 0; node < nodeCpus.size(); ++node) {
+            for (int cpu : nodeCpus[node]) {
+                if (static_cast<size_t>(cpu) >= cpuNodes.size()) {
+                    cpuNodes.resize(cpu + 1, 0);
+                }
+                cpuNodes[cpu] = node;
+            }
+        }
+
+        auto distance = [this, &ids](size_t from, size_t to) {
+            auto it = std::find(ids.begin(), ids.end(), sysfsIds[to]);
+            size_t column = it - ids.begin();
+            return column < distances[from].size() ? distances[from][column] : 0;
+        };
+        byDistance.resize(nodeCpus.size());
+        for (size_t node = 0; node < nodeCpus.size(); ++node) {
+            std::vector<size_t> &order = byDistance[node];
+            order.resize(nodeCpus.size());
+            std::iota(order.begin(), order.end(), 0);
+            std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+                if ((a == node) != (b == node)) {
+                    return a == node;
+                }
+                return distance(node, a) < distance(node, b);
+            });
+        }
+    }
+
+    static std::string readLine(const std::string &path)
+    {
+        std::ifstream file(path);
+        std::string line;
+        std::getline(file, line);
+        return line;
+    }
+};
+
+#endif // NUMA_H
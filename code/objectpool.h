@@ -0,0 +1,155 @@
+#ifndef OBJECTPOOL_H
+#define OBJECTPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+/**
+ * Recycles the memory of the objects of type T, see Recyclable. A block freed
+ * by a thread goes to the cache of that thread and is reused by its next
+ * allocation, the blocks only moving between the caches through a shared list
+ * and by batches: a thread gives batchSize blocks back once its cache holds
+ * twice as many, and takes up to batchSize ones when its cache is empty.
+ *
+ * The runnables created by a producer and freed by the workers thus flow back
+ * to the producer without ever going through the global allocator, one lock
+ * per batch.
+ */
+template<typename T>
+class ObjectPool
+{
+    static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "over-aligned types aren't supported");
+
+public:
+    static constexpr size_t batchSize = 32;
+    // The most blocks the shared list keeps, the surplus being freed
+    static constexpr size_t maxShared = 64 * batchSize;
+
+    static ObjectPool &instance()
+    {
+        static ObjectPool pool;
+        return pool;
+    }
+
+    /* Returns a block for a T, uninitialized. */
+    void *allocate()
+    {
+        std::vector<void *> &blocks = cache().blocks;
+        if (blocks.empty()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            size_t nb = std::min(batchSize, shared.size());
+            blocks.insert(blocks.end(), shared.end() - nb, shared.end());
+            shared.resize(shared.size() - nb);
+        }
+        if (blocks.empty()) {
+            nbCreated.fetch_add(1, std::memory_order_relaxed);
+            return ::operator new(sizeof(T));
+        }
+        void *block = blocks.back();
+        blocks.pop_back();
+        return block;
+    }
+
+    /* Takes back a block returned by allocate(), from any thread. */
+    void deallocate(void *block)
+    {
+        std::vector<void *> &blocks = cache().blocks;
+        blocks.push_back(block);
+        if (blocks.size() >= 2 * batchSize) {
+            release(blocks, batchSize);
+        }
+    }
+
+    /* Returns the number of blocks taken from the global allocator so far. */
+    size_t created() const { return nbCreated.load(std::memory_order_relaxed); }
+
+    /* Returns the number of blocks in the shared list. */
+    size_t available()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return shared.size();
+    }
+
+private:
+    /**
+     * The blocks of a thread, given back to the shared list when it exits.
+     */
+    struct Cache
+    {
+        std::vector<void *> blocks;
+
+        Cache() { blocks.reserve(2 * batchSize); }
+        ~Cache() { ObjectPool::instance().release(blocks, blocks.size()); }
+    };
+
+    std::mutex mutex;
+    std::vector<void *> shared;
+    std::atomic<size_t> nbCreated{0};
+
+    ObjectPool() { shared.reserve(maxShared); }
+
+    ~ObjectPool()
+    {
+        for (void *block : shared) {
+            ::operator delete(block);
+        }
+    }
+
+    static Cache &cache()
+    {
+        static thread_local Cache cache;
+        return cache;
+    }
+
+    /* Moves the last nb blocks of a cache to the shared list. */
+    void release(std::vector<void *> &blocks, size_t nb)
+    {
+        std::vector<void *>::iterator first = blocks.end() - nb;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            size_t kept = std::min(nb, maxShared - shared.size());
+            shared.insert(shared.end(), first, first + kept);
+            first += kept;
+        }
+        for (auto it = first; it != blocks.end(); ++it) {
+            ::operator delete(*it);
+        }
+        blocks.resize(blocks.size() - nb);
+    }
+};
+
+/**
+ * Makes new and delete of T go through ObjectPool<T>, which is all it takes
+ * for a runnable to be recycled once the pool is done with it:
+ *
+ *     class ResizeTask : public Runnable, public Recyclable<ResizeTask> { ... };
+ *     pool.start(std::make_unique<ResizeTask>(...));
+ *
+ * The classes deriving from T, whose size differs, use the global allocator.
+ */
+template<typename T>
+class Recyclable
+{
+public:
+    static void *operator new(std::size_t size)
+    {
+        return size == sizeof(T) ? ObjectPool<T>::instance().allocate() : ::operator new(size);
+    }
+
+    // NOTE: the deleting destructor of a virtual class passes the size of the
+    // object being deleted, whatever the static type of the pointer
+    static void operator delete(void *ptr, std::size_t size)
+    {
+        if (size == sizeof(T)) {
+            ObjectPool<T>::instance().deallocate(ptr);
+        } else {
+            ::operator delete(ptr);
+        }
+    }
+};
+
+#endif // OBJECTPOOL_H
@@ -0,0 +1,160 @@
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * The values of the counters read by PerfCounters. The counters that couldn't
+ * be opened stay at 0.
+ */
+struct PerfSample
+{
+    uint64_t instructions = 0;
+    uint64_t cycles = 0;
+    uint64_t cacheMisses = 0;
+    uint64_t contextSwitches = 0;
+    uint64_t migrations = 0;
+
+    PerfSample operator-(const PerfSample &other) const
+    {
+        PerfSample result;
+        result.instructions = instructions - other.instructions;
+        result.cycles = cycles - other.cycles;
+        result.cacheMisses = cacheMisses - other.cacheMisses;
+        result.contextSwitches = contextSwitches - other.contextSwitches;
+        result.migrations = migrations - other.migrations;
+        return result;
+    }
+
+    PerfSample &operator+=(const PerfSample &other)
+    {
+        instructions += other.instructions;
+        cycles += other.cycles;
+        cacheMisses += other.cacheMisses;
+        contextSwitches += other.contextSwitches;
+        migrations += other.migrations;
+        return *this;
+    }
+};
+
+/**
+ * A group of perf_event_open counters following the thread that created the
+ * object, on whatever CPU it runs, read all at once with a single read().
+ *
+ * The hardware counters (instructions, cycles, cache misses) are often missing
+ * on VMs or forbidden by perf_event_paranoid, in which case only the software
+ * ones (context switches, CPU migrations) are opened. Each counter first tries
+ * to count the kernel side too, and falls back to user space only.
+ */
+class PerfCounters
+{
+public:
+    PerfCounters()
+    {
+        for (size_t i = 0; i < nbEvents; ++i) {
+            int fd = open(events[i].type, events[i].config, fds[0]);
+            if (fd >= 0) {
+                // NOTE: the group reads the values in the order the counters
+                // joined it, which skips the ones that failed to open
+                fds[nbOpen] = fd;
+                order[nbOpen++] = i;
+            }
+        }
+    }
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    ~PerfCounters()
+    {
+        for (size_t i = 0; i < nbOpen; ++i) {
+            close(fds[i]);
+        }
+    }
+
+    /* Whether at least one counter could be opened. */
+    bool isOpen() const { return nbOpen > 0; }
+
+    /* Whether at least one of the hardware counters could be opened. */
+    bool hasHardware() const
+    {
+        for (size_t i = 0; i < nbOpen; ++i) {
+            if (events[order[i]].type == PERF_TYPE_HARDWARE) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* Returns the current values, to be subtracted from a previous read. */
+    PerfSample read() const
+    {
+        PerfSample sample;
+        if (nbOpen == 0) {
+            return sample;
+        }
+        // PERF_FORMAT_GROUP: the number of values followed by the values
+        std::array<uint64_t, nbEvents + 1> values{};
+        if (::read(fds[0], values.data(), sizeof(values)) <= 0) {
+            return sample;
+        }
+        for (size_t i = 0; i < nbOpen && i < values[0]; ++i) {
+            sample.*events[order[i]].field = values[i + 1];
+        }
+        return sample;
+    }
+
+private:
+    struct event_t
+    {
+        uint32_t type;
+        uint64_t config;
+        uint64_t PerfSample::*field;
+    };
+
+    // NOTE: the hardware counters come first so that one of them leads the
+    // group when they are available
+    static constexpr size_t nbEvents = 5;
+    static constexpr event_t events[nbEvents] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, &PerfSample::instructions},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, &PerfSample::cycles},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, &PerfSample::cacheMisses},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, &PerfSample::contextSwitches},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, &PerfSample::migrations},
+    };
+
+    // The fds of the opened counters, the first one leading the group
+    std::array<int, nbEvents> fds{-1, -1, -1, -1, -1};
+    // The index in events of each opened counter
+    std::array<size_t, nbEvents> order{};
+    size_t nbOpen = 0;
+
+    /* Opens a counter of the calling thread, returns -1 on failure. */
+    static int open(uint32_t type, uint64_t config, int group)
+    {
+        for (int excludeKernel = 0; excludeKernel < 2; ++excludeKernel) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.type = type;
+            attr.size = sizeof(attr);
+            attr.config = config;
+            attr.read_format = PERF_FORMAT_GROUP;
+            attr.exclude_kernel = excludeKernel;
+            attr.exclude_hv = 1;
+            int fd = static_cast<int>(
+                syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC));
+            if (fd >= 0) {
+                return fd;
+            }
+        }
+        return -1;
+    }
+};
+
+#endif // PERFCOUNTERS_H
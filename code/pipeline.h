@@ -0,0 +1,391 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <cassert>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <pcosynchro/pcohoaremonitor.h>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "objectpool.h"
+#include "threadpool.h"
+
+/**
+ * How a stage of a Pipeline processes its tokens.
+ * - SerialInOrder: one token at a time, in the order the source produced them
+ * - Parallel: any number of tokens at the same time, in any order
+ */
+enum class StageMode { SerialInOrder, Parallel };
+
+namespace pipeline_detail {
+
+/**
+ * Move-only type erased value travelling between two stages. std::any would
+ * force the payloads to be copyable.
+ */
+class Value
+{
+public:
+    Value() = default;
+
+    template<typename T>
+    explicit Value(T &&value)
+        : holder(std::make_unique<Holder<std::decay_t<T>>>(std::forward<T>(value)))
+    {}
+
+    template<typename T>
+    T take()
+    {
+        assert(holder);
+        return std::move(static_cast<Holder<T> *>(holder.get())->value);
+    }
+
+private:
+    struct Base
+    {
+        virtual ~Base() = default;
+    };
+
+    template<typename T>
+    struct Holder : Base
+    {
+        explicit Holder(T &&value)
+            : value(std::move(value))
+        {}
+        explicit Holder(const T &value)
+            : value(value)
+        {}
+        T value;
+    };
+
+    std::unique_ptr<Base> holder;
+};
+
+struct Stage
+{
+    StageMode mode;
+    std::function<Value(Value &&)> fn;
+};
+
+} // namespace pipeline_detail
+
+/**
+ * A typed sequence of stages. In is the type consumed by the first stage (void
+ * for a source) and Out the type produced by the last one (void for a sink).
+ * Chains are built with makeSource()/makeStage() and composed with operator&,
+ * a complete pipeline being a PipelineChain<void, void>.
+ */
+template<typename In, typename Out>
+class PipelineChain
+{
+public:
+    template<typename Next>
+    PipelineChain<In, Next> operator&(PipelineChain<Out, Next> next) &&
+    {
+        static_assert(!std::is_void_v<Out>, "cannot add a stage after a sink");
+
+        PipelineChain<In, Next> chain;
+        chain.source = std::move(source);
+        chain.stages = std::move(stages);
+        for (auto &stage : next.stages) {
+            chain.stages.push_back(std::move(stage));
+        }
+        return chain;
+    }
+
+private:
+    template<typename, typename>
+    friend class PipelineChain;
+    friend class Pipeline;
+
+    template<typename T, typename F>
+    friend PipelineChain<void, T> makeSource(F &&source);
+
+    template<typename I, typename O, typename F>
+    friend PipelineChain<I, O> makeStage(StageMode mode, F &&fn);
+
+    // Only set when In is void, returns false once the input is exhausted
+    std::function<bool(pipeline_detail::Value &)> source;
+    std::vector<pipeline_detail::Stage> stages;
+};
+
+/**
+ * Creates the input of a pipeline. The source is called serially and returns
+ * std::nullopt once there is nothing left to process.
+ */
+template<typename T, typename F>
+PipelineChain<void, T> makeSource(F &&source)
+{
+    PipelineChain<void, T> chain;
+    chain.source = [source = std::forward<F>(source)](pipeline_detail::Value &value) mutable {
+        std::optional<T> item = source();
+        if (!item) {
+            return false;
+        }
+        value = pipeline_detail::Value(std::move(*item));
+        return true;
+    };
+    return chain;
+}
+
+/**
+ * Creates a stage transforming an In into an Out. A stage with an Out of void
+ * is a sink and ends the pipeline.
+ */
+template<typename In, typename Out, typename F>
+PipelineChain<In, Out> makeStage(StageMode mode, F &&fn)
+{
+    static_assert(!std::is_void_v<In>, "use makeSource() for the first stage");
+
+    PipelineChain<In, Out> chain;
+    chain.stages.push_back(pipeline_detail::Stage{
+        mode, [fn = std::forward<F>(fn)](pipeline_detail::Value &&value) mutable {
+            if constexpr (std::is_void_v<Out>) {
+                fn(value.take<In>());
+                return pipeline_detail::Value();
+            } else {
+                return pipeline_detail::Value(fn(value.take<In>()));
+            }
+        }});
+    return chain;
+}
+
+/**
+ * Runs a chain of stages over a pool, TBB parallel_pipeline style.
+ *
+ * The thread calling run() pulls tokens from the source as long as less than
+ * maxTokens are in flight, which bounds the memory used by the pipeline. Each
+ * token then goes through the consecutive stages within the same runnable, so
+ * on the same worker, until it reaches a serial stage that isn't its turn yet.
+ * It is then parked in that stage and resumed by the worker releasing the stage
+ * once its predecessor went through.
+ *
+ * When the pool rejects a token (queue full or pool shut down), the token is
+ * processed by the thread that tried to submit it, once that thread is done
+ * with the token it is processing if any.
+ */
+class Pipeline
+{
+public:
+    Pipeline(PipelineChain<void, void> chain, size_t maxTokens)
+        : impl(std::make_shared<Impl>(std::move(chain), maxTokens))
+    {}
+
+    /**
+     * Processes the whole input and returns once every token went through the
+     * last stage. A pipeline can be run several times but not concurrently.
+     */
+    template<typename Pool>
+    void run(Pool &pool)
+    {
+        impl->run([&pool](std::unique_ptr<Runnable> runnable) {
+            // NOTE: on refusal the pool calls cancelRun() which processes the
+            // token inline, there is nothing left to do here.
+            pool.start(std::move(runnable));
+        });
+    }
+
+private:
+    struct Token
+    {
+        // Position of the token in the source, used by the serial stages
+        size_t seq;
+        pipeline_detail::Value value;
+    };
+
+    /**
+     * State of a SerialInOrder stage, only meaningful for those.
+     */
+    struct serial_t
+    {
+        // The seq of the next token allowed through
+        size_t next = 0;
+        // Whether a token is currently being processed by the stage
+        bool busy = false;
+        // Tokens that arrived before their turn
+        std::map<size_t, Token> parked;
+    };
+
+    /**
+     * The state shared with the tokens. The runnables keep it alive since the
+     * worker releasing the last token is still within the monitor when run()
+     * wakes up and may return.
+     */
+    class Impl : public PcoHoareMonitor, public std::enable_shared_from_this<Impl>
+    {
+    public:
+        Impl(PipelineChain<void, void> chain, size_t maxTokens)
+            : maxTokens(maxTokens)
+            , source(std::move(chain.source))
+            , stages(std::move(chain.stages))
+            , serial(stages.size())
+        {
+            assert(maxTokens > 0);
+        }
+
+        void run(std::function<void(std::unique_ptr<Runnable>)> submitFn)
+        {
+            for (auto &stage : serial) {
+                stage.next = 0;
+                stage.busy = false;
+            }
+            submit = std::move(submitFn);
+
+            size_t seq = 0;
+            while (true) {
+                monitorIn();
+                while (inFlight >= maxTokens) {
+                    wait(tokenReleased);
+                }
+                ++inFlight;
+                monitorOut();
+
+                pipeline_detail::Value value;
+                if (!source(value)) {
+                    monitorIn();
+                    --inFlight;
+                    monitorOut();
+                    break;
+                }
+
+                submit(std::make_unique<TokenRunnable>(
+                    shared_from_this(), Token{seq++, std::move(value)}, 0));
+            }
+
+            monitorIn();
+            while (inFlight > 0) {
+                wait(tokenReleased);
+            }
+            monitorOut();
+        }
+
+        /**
+         * Moves a token through the stages starting at the given one until it
+         * either leaves the pipeline or gets parked in a serial stage.
+         */
+        void process(Token token, size_t stage)
+        {
+            for (; stage < stages.size(); ++stage) {
+                if (stages[stage].mode == StageMode::Parallel) {
+                    token.value = stages[stage].fn(std::move(token.value));
+                    continue;
+                }
+
+                serial_t &state = serial[stage];
+                monitorIn();
+                if (state.busy || state.next != token.seq) {
+                    state.parked.emplace(token.seq, std::move(token));
+                    monitorOut();
+                    return;
+                }
+                state.busy = true;
+                monitorOut();
+
+                token.value = stages[stage].fn(std::move(token.value));
+
+                monitorIn();
+                state.busy = false;
+                ++state.next;
+                std::optional<Token> released;
+                auto it = state.parked.find(state.next);
+                if (it != state.parked.end()) {
+                    released = std::move(it->second);
+                    state.parked.erase(it);
+                }
+                monitorOut();
+
+                // NOTE: the released token goes through the pool so that it
+                // doesn't wait for this one to reach the end of the pipeline.
+                if (released) {
+                    submit(std::make_unique<TokenRunnable>(
+                        shared_from_this(), std::move(*released), stage));
+                }
+            }
+
+            monitorIn();
+            --inFlight;
+            signal(tokenReleased);
+            monitorOut();
+        }
+
+        /**
+         * Processes a token refused by the pool on the calling thread. A
+         * thread already processing a token defers it until done, rather than
+         * recursing once per token of a run of refusals.
+         */
+        static void processRefused(std::shared_ptr<Impl> pipeline, Token token, size_t stage)
+        {
+            struct refused_t
+            {
+                std::shared_ptr<Impl> pipeline;
+                Token token;
+                size_t stage;
+            };
+            // The tokens deferred by the outermost call on the thread, if any
+            static thread_local std::vector<refused_t> *deferred = nullptr;
+
+            if (deferred) {
+                deferred->push_back({std::move(pipeline), std::move(token), stage});
+                return;
+            }
+            std::vector<refused_t> pending;
+            pending.push_back({std::move(pipeline), std::move(token), stage});
+            deferred = &pending;
+            for (size_t i = 0; i < pending.size(); ++i) {
+                refused_t next = std::move(pending[i]);
+                next.pipeline->process(std::move(next.token), next.stage);
+            }
+            deferred = nullptr;
+        }
+
+    private:
+        // The max number of tokens between the source and the last stage
+        size_t maxTokens;
+        // The number of tokens between the source and the last stage
+        size_t inFlight = 0;
+
+        std::function<bool(pipeline_detail::Value &)> source;
+        std::vector<pipeline_detail::Stage> stages;
+        std::vector<serial_t> serial;
+
+        // Gives a runnable to the pool given to run()
+        std::function<void(std::unique_ptr<Runnable>)> submit;
+
+        // Signaled each time a token leaves the pipeline
+        Condition tokenReleased;
+    };
+
+    // NOTE: one is created per token and stage, they are recycled
+    class TokenRunnable : public Runnable, public Recyclable<TokenRunnable>
+    {
+    public:
+        TokenRunnable(std::shared_ptr<Impl> pipeline, Token token, size_t stage)
+            : pipeline(std::move(pipeline))
+            , token(std::move(token))
+            , stage(stage)
+        {}
+
+        void run() override { pipeline->process(std::move(token), stage); }
+
+        // Caller runs: the token cannot be dropped or run() would never return
+        void cancelRun() override
+        {
+            Impl::processRefused(std::move(pipeline), std::move(token), stage);
+        }
+
+        std::string id() override { return "pipeline"; }
+
+    private:
+        std::shared_ptr<Impl> pipeline;
+        Token token;
+        size_t stage;
+    };
+
+    std::shared_ptr<Impl> impl;
+};
+
+#endif // PIPELINE_H
@@ -0,0 +1,392 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "histogram.h"
+#include "threadpool.h"
+
+///
+/// Open-loop load generator for the ThreadPool. Unlike the tests, which submit
+/// as fast as possible and so slow down whenever the pool does, the arrivals
+/// follow a schedule that doesn't depend on how the pool copes. The latency of
+/// a task is measured from its scheduled arrival to the end of its run, so the
+/// time spent queued (or behind a late dispatcher) is accounted for.
+///
+/// Writes one CSV row per interval: arrivals, rejections, p50/p99/p99.9 of the
+/// latency of the tasks completed in the interval, thread count and queue depth.
+///
+
+typedef std::chrono::steady_clock Clock;
+
+static const char *usage =
+    "usage: pool_loadgen [options]\n"
+    "  --threads N          maxThreadCount of the pool (8)\n"
+    "  --waiting N          maxNbWaiting of the pool (100)\n"
+    "  --idle-timeout MS    idleTimeout of the pool (1000)\n"
+    "  --arrival KIND       poisson, bursty or trace (poisson)\n"
+    "  --rate R             arrivals per second, within the on periods if bursty (1000)\n"
+    "  --on MS --off MS     length of the on and off periods of bursty (100, 400)\n"
+    "  --trace FILE         one arrival per line: offset_us [service_us], # comments\n"
+    "  --service KIND       fixed, uniform, exp or lognormal (exp)\n"
+    "  --service-mean US    mean service time (500)\n"
+    "  --service-sigma S    sigma of the underlying normal of lognormal (1.0)\n"
+    "  --spin               burn CPU during the service time instead of sleeping\n"
+    "  --duration S         how long arrivals are generated (10)\n"
+    "  --interval MS        length of a CSV row (1000)\n"
+    "  --seed N             seed of the random generators (42)\n"
+    "  --output FILE        where to write the CSV (stdout)\n";
+
+struct Options
+{
+    int threads = 8;
+    int waiting = 100;
+    int idleTimeoutMs = 1000;
+    std::string arrival = "poisson";
+    double rate = 1000;
+    double onMs = 100;
+    double offMs = 400;
+    std::string trace;
+    std::string service = "exp";
+    double serviceMeanUs = 500;
+    double serviceSigma = 1.0;
+    bool spin = false;
+    double durationS = 10;
+    int intervalMs = 1000;
+    unsigned seed = 42;
+    std::string output;
+};
+
+///
+/// \brief An arrival, offsets are relative to the beginning of the run
+///
+struct Arrival
+{
+    std::chrono::nanoseconds offset;
+    std::chrono::nanoseconds service;
+};
+
+///
+/// \brief The ArrivalProcess class
+/// Generates the arrivals in order, until it returns std::nullopt
+class ArrivalProcess
+{
+public:
+    explicit ArrivalProcess(const Options &options)
+        : options(options)
+        , rng(options.seed)
+        , gap(options.rate)
+        , end(std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::duration<double>(options.durationS)))
+    {}
+
+    /* Reads the trace to replay, returns false if it cannot be read. */
+    bool loadTrace(const std::string &path)
+    {
+        std::ifstream in(path);
+        if (!in) {
+            return false;
+        }
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            double offsetUs = 0;
+            double serviceUs = -1;
+            if (std::sscanf(line.c_str(), "%lf %lf", &offsetUs, &serviceUs) < 1) {
+                return false;
+            }
+            Arrival arrival{toNs(offsetUs), serviceUs < 0 ? drawService() : toNs(serviceUs)};
+            traced.push_back(arrival);
+        }
+        return true;
+    }
+
+    std::optional<Arrival> next()
+    {
+        std::chrono::nanoseconds offset;
+        if (options.arrival == "trace") {
+            if (nextTraced == traced.size()) {
+                return std::nullopt;
+            }
+            return traced[nextTraced++];
+        } else if (options.arrival == "bursty") {
+            // NOTE: a Poisson process running only during the on periods, its
+            // time is stretched over the on and off periods
+            onTime += gap(rng);
+            double on = options.onMs / 1000;
+            double period = on + options.offMs / 1000;
+            double seconds = std::floor(onTime / on) * period + std::fmod(onTime, on);
+            offset = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::duration<double>(seconds));
+        } else {
+            onTime += gap(rng);
+            offset = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::duration<double>(onTime));
+        }
+
+        if (offset >= end) {
+            return std::nullopt;
+        }
+        return Arrival{offset, drawService()};
+    }
+
+private:
+    const Options &options;
+    std::mt19937_64 rng;
+    // The time between two arrivals of the Poisson process
+    std::exponential_distribution<double> gap;
+    std::chrono::nanoseconds end;
+    // The time of the last arrival of the Poisson process, in seconds
+    double onTime = 0;
+    std::vector<Arrival> traced;
+    size_t nextTraced = 0;
+
+    static std::chrono::nanoseconds toNs(double us)
+    {
+        return std::chrono::nanoseconds(static_cast<int64_t>(us * 1000));
+    }
+
+    std::chrono::nanoseconds drawService()
+    {
+        double mean = options.serviceMeanUs;
+        double us = mean;
+        if (options.service == "uniform") {
+            us = std::uniform_real_distribution<double>(0, 2 * mean)(rng);
+        } else if (options.service == "exp") {
+            us = std::exponential_distribution<double>(1 / mean)(rng);
+        } else if (options.service == "lognormal") {
+            double sigma = options.serviceSigma;
+            us = std::lognormal_distribution<double>(std::log(mean) - sigma * sigma / 2, sigma)(rng);
+        }
+        return toNs(us);
+    }
+};
+
+///
+/// \brief What the tasks and the dispatcher report to the reporter
+///
+struct Counters
+{
+    std::atomic<uint64_t> arrivals{0};
+    std::atomic<uint64_t> rejected{0};
+    // From the scheduled arrival to the end of the run, in nanoseconds
+    AtomicHistogram latency;
+};
+
+///
+/// \brief The LoadRunnable class
+/// Takes its service time and records its latency
+class LoadRunnable : public Runnable
+{
+public:
+    LoadRunnable(Counters &counters, Clock::time_point arrival, std::chrono::nanoseconds service, bool spin)
+        : counters(counters)
+        , arrival(arrival)
+        , service(service)
+        , spin(spin)
+    {}
+
+    void run() override
+    {
+        if (spin) {
+            Clock::time_point until = Clock::now() + service;
+            while (Clock::now() < until) {
+            }
+        } else {
+            std::this_thread::sleep_for(service);
+        }
+        counters.latency.record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - arrival).count());
+    }
+
+    void cancelRun() override {}
+
+    std::string id() override { return "load"; }
+
+private:
+    Counters &counters;
+    Clock::time_point arrival;
+    std::chrono::nanoseconds service;
+    bool spin;
+};
+
+///
+/// \brief Parses the command line, returns std::nullopt on error
+///
+static std::optional<Options> parse(int argc, char **argv)
+{
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--spin") {
+            options.spin = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            return std::nullopt;
+        }
+        std::string value = argv[++i];
+        try {
+            if (arg == "--threads") {
+                options.threads = std::stoi(value);
+            } else if (arg == "--waiting") {
+                options.waiting = std::stoi(value);
+            } else if (arg == "--idle-timeout") {
+                options.idleTimeoutMs = std::stoi(value);
+            } else if (arg == "--arrival") {
+                options.arrival = value;
+            } else if (arg == "--rate") {
+                options.rate = std::stod(value);
+            } else if (arg == "--on") {
+                options.onMs = std::stod(value);
+            } else if (arg == "--off") {
+                options.offMs = std::stod(value);
+            } else if (arg == "--trace") {
+                options.trace = value;
+            } else if (arg == "--service") {
+                options.service = value;
+            } else if (arg == "--service-mean") {
+                options.serviceMeanUs = std::stod(value);
+            } else if (arg == "--service-sigma") {
+                options.serviceSigma = std::stod(value);
+            } else if (arg == "--duration") {
+                options.durationS = std::stod(value);
+            } else if (arg == "--interval") {
+                options.intervalMs = std::stoi(value);
+            } else if (arg == "--seed") {
+                options.seed = std::stoul(value);
+            } else if (arg == "--output") {
+                options.output = value;
+            } else {
+                return std::nullopt;
+            }
+        } catch (const std::exception &) {
+            return std::nullopt;
+        }
+    }
+
+    bool valid = options.threads > 0 && options.waiting >= 0 && options.rate > 0
+                 && options.onMs > 0 && options.offMs >= 0 && options.intervalMs > 0
+                 && (options.arrival == "poisson" || options.arrival == "bursty"
+                     || (options.arrival == "trace" && !options.trace.empty()))
+                 && (options.service == "fixed" || options.service == "uniform"
+                     || options.service == "exp" || options.service == "lognormal");
+    if (!valid) {
+        return std::nullopt;
+    }
+    return options;
+}
+
+///
+/// \brief Prints a CSV row every interval until stop is set
+///
+static void report(
+    std::ostream &out, const Options &options, ThreadPool &pool, Counters &counters,
+    Clock::time_point begin, const std::atomic<bool> &stop)
+{
+    out << "time_s,arrivals,rejected,rejection_rate,completed,p50_us,p99_us,p999_us,threads,"
+           "queued\n";
+
+    uint64_t lastArrivals = 0;
+    uint64_t lastRejected = 0;
+    Histogram last;
+    Clock::time_point tick = begin;
+    bool stopping = false;
+    while (!stopping) {
+        tick += std::chrono::milliseconds(options.intervalMs);
+        std::this_thread::sleep_until(tick);
+        stopping = stop.load();
+
+        uint64_t arrivals = counters.arrivals.load();
+        uint64_t rejected = counters.rejected.load();
+        Histogram latency = counters.latency.snapshot();
+        // NOTE: the histogram of the interval is the difference of the
+        // cumulative ones, bucket by bucket
+        Histogram interval;
+        for (size_t i = 0; i < Histogram::nbBuckets; ++i) {
+            uint64_t count = latency.bucketCount(i) - last.bucketCount(i);
+            if (count) {
+                interval.record(Histogram::lowerBound(i), count);
+            }
+        }
+
+        uint64_t nbArrivals = arrivals - lastArrivals;
+        uint64_t nbRejected = rejected - lastRejected;
+        out << std::chrono::duration<double>(Clock::now() - begin).count() << "," << nbArrivals
+            << "," << nbRejected << ","
+            << (nbArrivals ? static_cast<double>(nbRejected) / nbArrivals : 0.0) << ","
+            << interval.count() << "," << interval.percentile(0.5) / 1000.0 << ","
+            << interval.percentile(0.99) / 1000.0 << "," << interval.percentile(0.999) / 1000.0
+            << "," << pool.currentNbThreads() << "," << pool.pendingCount() << std::endl;
+
+        lastArrivals = arrivals;
+        lastRejected = rejected;
+        last = latency;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::optional<Options> options = parse(argc, argv);
+    if (!options) {
+        std::cerr << usage;
+        return 1;
+    }
+
+    ArrivalProcess arrivals(*options);
+    if (options->arrival == "trace" && !arrivals.loadTrace(options->trace)) {
+        std::cerr << "pool_loadgen: cannot read the trace " << options->trace << "\n";
+        return 1;
+    }
+
+    std::ofstream file;
+    if (!options->output.empty()) {
+        file.open(options->output);
+        if (!file) {
+            std::cerr << "pool_loadgen: cannot write to " << options->output << "\n";
+            return 1;
+        }
+    }
+    std::ostream &out = options->output.empty() ? std::cout : file;
+
+    Counters counters;
+    ThreadPool pool(options->threads, options->waiting,
+                    std::chrono::milliseconds(options->idleTimeoutMs));
+
+    Clock::time_point begin = Clock::now();
+    std::atomic<bool> stop{false};
+    std::thread reporter(report, std::ref(out), std::cref(*options), std::ref(pool),
+                         std::ref(counters), begin, std::cref(stop));
+
+    // NOTE: the dispatcher never waits for the pool, a late arrival is
+    // submitted right away and its latency still counts from its schedule
+    while (std::optional<Arrival> arrival = arrivals.next()) {
+        Clock::time_point at = begin + arrival->offset;
+        std::this_thread::sleep_until(at);
+        counters.arrivals.fetch_add(1, std::memory_order_relaxed);
+        if (!pool.start(std::make_unique<LoadRunnable>(counters, at, arrival->service, options->spin))) {
+            counters.rejected.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    pool.waitForDone();
+    stop = true;
+    reporter.join();
+
+    Histogram latency = counters.latency.snapshot();
+    std::cerr << "arrivals " << counters.arrivals << ", rejected " << counters.rejected
+              << ", p50 " << latency.percentile(0.5) / 1000.0 << " us, p99 "
+              << latency.percentile(0.99) / 1000.0 << " us, p99.9 "
+              << latency.percentile(0.999) / 1000.0 << " us\n";
+    return 0;
+}
@@ -0,0 +1,118 @@
+#ifndef POOLCLOCK_H
+#define POOLCLOCK_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+/**
+ * The clock driving the idle timeouts of a ThreadPool. The time points are
+ * steady_clock ones, a virtual clock only decides how they move.
+ */
+class PoolClock
+{
+public:
+    typedef std::chrono::steady_clock::duration duration;
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    virtual ~PoolClock() = default;
+
+    virtual time_point now() = 0;
+
+    /**
+     * Sleeps until the given time is reached or until wake is set. A thread
+     * setting wake has to call notify() afterwards.
+     */
+    virtual void sleepUntil(time_point until, const std::atomic<bool> &wake) = 0;
+
+    /* Makes the sleepers check their wake flag. */
+    virtual void notify() = 0;
+};
+
+/**
+ * The real time, what a pool uses by default.
+ */
+class SteadyClock : public PoolClock
+{
+public:
+    time_point now() override { return std::chrono::steady_clock::now(); }
+
+    void sleepUntil(time_point until, const std::atomic<bool> &wake) override
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait_until(lock, until, [&wake] { return wake.load(); });
+    }
+
+    void notify() override
+    {
+        // NOTE: the mutex makes sure that a sleeper is either sleeping or
+        // hasn't checked its flag yet
+        { std::lock_guard<std::mutex> lock(mutex); }
+        cond.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable cond;
+};
+
+/**
+ * A virtual time that only moves when advance() is called, so that tests can
+ * go through hours of timeouts in no time and without depending on the
+ * scheduling of the machine. It starts at the epoch of steady_clock.
+ */
+class ManualClock : public PoolClock
+{
+public:
+    time_point now() override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return current;
+    }
+
+    void sleepUntil(time_point until, const std::atomic<bool> &wake) override
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ++nbSleepers;
+        sleepersCond.notify_all();
+        cond.wait(lock, [this, until, &wake] { return current >= until || wake.load(); });
+        --nbSleepers;
+    }
+
+    void notify() override
+    {
+        { std::lock_guard<std::mutex> lock(mutex); }
+        cond.notify_all();
+    }
+
+    /* Moves the time forward and wakes up the sleepers whose time came. */
+    void advance(duration by)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            current += by;
+        }
+        cond.notify_all();
+    }
+
+    /**
+     * Blocks until at least the given number of threads sleep on the clock,
+     * which tells a test that they are done reacting to the last advance().
+     */
+    void waitForSleepers(size_t nb)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        sleepersCond.wait(lock, [this, nb] { return nbSleepers >= nb; });
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::condition_variable sleepersCond;
+    time_point current{};
+    size_t nbSleepers = 0;
+};
+
+#endif // POOLCLOCK_H
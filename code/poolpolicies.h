@@ -0,0 +1,66 @@
+#ifndef POOLPOLICIES_H
+#define POOLPOLICIES_H
+
+/**
+ * The compile time policies of BasicThreadPool, besides its sync backend (see
+ * syncpolicy.h). A pool only pays for what its policies enable, the paths of
+ * the disabled features being discarded with if constexpr. The members only
+ * available with a given policy fail to compile without it.
+ */
+
+/**
+ * The queue indexes the tasks by id and group, which costs two hash map
+ * insertions and erasures per queued task, so that cancel() and cancelGroup()
+ * can withdraw them.
+ */
+struct IndexedQueue
+{
+    static constexpr bool indexed = true;
+};
+
+/**
+ * A plain FIFO queue, without cancel() and cancelGroup(). The tasks can still
+ * be cancelled through their CancellationToken.
+ */
+struct PlainQueue
+{
+    static constexpr bool indexed = false;
+};
+
+/**
+ * Workers are started on demand, up to the maximum, and stopped once idle for
+ * longer than the idle timeout, which takes a timer thread.
+ */
+struct DynamicGrowth
+{
+    static constexpr bool fixed = false;
+};
+
+/**
+ * Every worker is started by the constructor and lives until the shutdown.
+ * There is no timer thread, the idle timeout and the clock are ignored.
+ */
+struct FixedGrowth
+{
+    static constexpr bool fixed = true;
+};
+
+/**
+ * The workers time and count what they run for stats(), and publish it for
+ * workerStates() and the watchdog.
+ */
+struct FullStats
+{
+    static constexpr bool enabled = true;
+};
+
+/**
+ * No clock is read around the tasks, stats(), workerStates() and the watchdog
+ * are unavailable. The task accounting keeps working when enabled.
+ */
+struct NoStats
+{
+    static constexpr bool enabled = false;
+};
+
+#endif // POOLPOLICIES_H
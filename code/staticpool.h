@@ -0,0 +1,333 @@
+#ifndef STATICPOOL_H
+#define STATICPOOL_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <pcosynchro/pcothread.h>
+#include <sys/mman.h>
+
+#include "syncpolicy.h"
+#include "threadoptions.h"
+#include "threadpool.h"
+
+/**
+ * A pool whose capacities are compile time constants: MaxThreads workers, all
+ * started by the constructor, and a ring of Capacity queued runnables. Every
+ * piece of its state lives in std::arrays within the object, nothing is
+ * allocated once it is constructed, which keeps the allocator and its jitter
+ * away from start() and from the workers. Combined with lockMemory(), the pool
+ * never page faults either.
+ *
+ * It trades the features of ThreadPool that need the heap or a clock for it:
+ * there are no idle timeouts, no stats, no cancellation by id or group and no
+ * task accounting. A running task still sees its token cancelled through
+ * ThreadPool::isCancelled(). The runnables themselves are still allocated by
+ * the caller.
+ */
+template<size_t MaxThreads, size_t Capacity, typename SyncPolicy = HoareSync>
+class StaticThreadPool
+{
+    static_assert(MaxThreads > 0, "a pool needs at least one worker");
+    static_assert(Capacity > 0, "a pool needs room for at least one runnable");
+
+public:
+    explicit StaticThreadPool(WorkerHooks hooks = {})
+        : StaticThreadPool(ThreadOptions{}, std::move(hooks))
+    {}
+
+    /* Same as above, the workers being set up as the given options say. */
+    explicit StaticThreadPool(ThreadOptions options, WorkerHooks hooks = {})
+        : options(std::move(options))
+        , hooks(std::move(hooks))
+    {
+        sync.lock();
+        for (size_t i = 0; i < MaxThreads; ++i) {
+            workers[i].thread = this->options.createThread(
+                [this, i] { return std::make_unique<PcoThread>(&StaticThreadPool::worker, this, i); },
+                nbOptionFailures);
+        }
+        nbThreads = MaxThreads;
+        sync.unlock();
+    }
+
+    ~StaticThreadPool()
+    {
+        shutdown(ShutdownMode::Drain);
+        if (locked) {
+            munlock(this, sizeof(*this));
+        }
+    }
+
+    /**
+     * Starts a runnable, handing it over to a parked worker when the queue is
+     * empty. Returns false, after calling cancelRun(), when the queue is full
+     * or the pool is shut down. Never blocks nor allocates.
+     */
+    bool start(std::unique_ptr<Runnable> runnable, CancellationToken token = {})
+    {
+        sync.lock();
+        if (stopped || nbQueued >= Capacity) {
+            sync.unlock();
+            runnable->cancelRun();
+            return false;
+        }
+
+        ++inFlight;
+        task_t task{std::move(runnable), std::move(token)};
+        if (nbQueued == 0 && nbIdle > 0) {
+            worker_t &wrkr = workers[idle[--nbIdle]];
+            wrkr.handoff = std::move(task);
+            ++nbActive;
+            wake(wrkr);
+        } else {
+            ring[(front + nbQueued) % Capacity] = std::move(task);
+            ++nbQueued;
+            if (nbIdle > 0) {
+                wake(workers[idle[--nbIdle]]);
+            }
+        }
+        sync.unlock();
+        return true;
+    }
+
+    /**
+     * Same as ThreadPool::shutdown(), the workers are joined once it returns.
+     */
+    ShutdownResult shutdown(
+        ShutdownMode mode = ShutdownMode::Drain,
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max())
+    {
+        sync.lock();
+        if (stopped) {
+            sync.unlock();
+            return {};
+        }
+        stopped = true;
+        size_t queued = nbQueued;
+        // NOTE: the other workers check stopped before they park
+        while (nbIdle > 0) {
+            wake(workers[idle[--nbIdle]]);
+        }
+        sync.unlock();
+
+        ShutdownResult result;
+        if (mode == ShutdownMode::CancelPending) {
+            result.cancelled = cancelPending();
+        } else if (
+            mode == ShutdownMode::Deadline
+            && deadline != std::chrono::steady_clock::time_point::max()) {
+            std::unique_lock<std::mutex> lock(idleMutex);
+            if (!idleCond.wait_until(lock, deadline, [this] { return nbQueued == 0; })) {
+                lock.unlock();
+                result.cancelled = cancelPending();
+                result.timedOut = true;
+            }
+        }
+
+        for (worker_t &wrkr : workers) {
+            wrkr.thread->join();
+        }
+        nbThreads = 0;
+        result.drained = queued > result.cancelled ? queued - result.cancelled : 0;
+        return result;
+    }
+
+    /**
+     * Blocks until the queue is empty and no runnable is running anymore, or
+     * until the timeout expires. Returns whether the pool is done.
+     */
+    bool waitForDone(std::chrono::milliseconds timeout = std::chrono::milliseconds::max())
+    {
+        std::unique_lock<std::mutex> lock(idleMutex);
+        auto done = [this] { return inFlight == 0; };
+        // NOTE: wait_for() overflows with milliseconds::max()
+        if (timeout == std::chrono::milliseconds::max()) {
+            idleCond.wait(lock, done);
+            return true;
+        }
+        return idleCond.wait_for(lock, timeout, done);
+    }
+
+    /**
+     * Locks the pages of the pool in RAM. Fails when it goes over
+     * RLIMIT_MEMLOCK without CAP_IPC_LOCK. The stacks of the workers and the
+     * runnables aren't covered, mlockall() is the way to lock those too.
+     */
+    bool lockMemory()
+    {
+        if (!locked) {
+            locked = mlock(this, sizeof(*this)) == 0;
+        }
+        return locked;
+    }
+
+    size_t currentNbThreads() { return nbThreads; }
+    size_t pendingCount() { return nbQueued; }
+    size_t activeCount() { return nbActive; }
+    size_t idleCount() { return nbIdleWorkers; }
+    size_t threadOptionFailures() { return nbOptionFailures; }
+
+    static constexpr size_t maxThreadCount() { return MaxThreads; }
+    static constexpr size_t capacity() { return Capacity; }
+
+private:
+    typedef typename SyncPolicy::Condition Condition;
+
+    struct task_t
+    {
+        std::unique_ptr<Runnable> runnable;
+        CancellationToken token;
+    };
+
+    struct worker_t : WorkerContext
+    {
+        std::unique_ptr<PcoThread> thread;
+        Condition cond;
+        // Cleared by whoever wakes the worker up
+        bool waiting = false;
+        // The task given by start() while the worker was parked, if any
+        task_t handoff;
+    };
+
+    SyncPolicy sync;
+    const ThreadOptions options;
+    // The settings of the options that couldn't be applied to a worker
+    std::atomic<size_t> nbOptionFailures{0};
+    WorkerHooks hooks;
+    std::array<worker_t, MaxThreads> workers;
+    // The queued tasks, from front on
+    std::array<task_t, Capacity> ring;
+    size_t front = 0;
+    // The parked workers, the one parked last on top
+    std::array<size_t, MaxThreads> idle{};
+    size_t nbIdle = 0;
+    bool stopped = false;
+    bool locked = false;
+
+    // Only modified within the monitor, readable from anywhere
+    std::atomic<size_t> nbQueued{0};
+    std::atomic<size_t> nbActive{0};
+    std::atomic<size_t> nbIdleWorkers{0};
+    std::atomic<size_t> nbThreads{0};
+    // The number of tasks queued or being run
+    std::atomic<size_t> inFlight{0};
+
+    // Used by waitForDone() and shutdown(), see ThreadPool
+    std::mutex idleMutex;
+    std::condition_variable idleCond;
+
+    /* Wakes up a worker popped from idle. Must be called within the monitor. */
+    void wake(worker_t &wrkr)
+    {
+        wrkr.waiting = false;
+        --nbIdleWorkers;
+        sync.signal(wrkr.cond);
+    }
+
+    /* Dequeues the front task. Must be called within the monitor with nbQueued > 0. */
+    task_t pop()
+    {
+        task_t task = std::move(ring[front]);
+        front = (front + 1) % Capacity;
+        --nbQueued;
+        if (stopped && nbQueued == 0) {
+            notifyIdle();
+        }
+        return task;
+    }
+
+    void tasksDone(size_t nb)
+    {
+        if (nb && inFlight.fetch_sub(nb) == nb) {
+            notifyIdle();
+        }
+    }
+
+    void notifyIdle()
+    {
+        { std::lock_guard<std::mutex> lock(idleMutex); }
+        idleCond.notify_all();
+    }
+
+    /**
+     * Withdraws the queued tasks one by one, calling cancelRun() outside of
+     * the monitor without gathering them anywhere. Returns their number.
+     */
+    size_t cancelPending()
+    {
+        size_t cancelled = 0;
+        while (true) {
+            sync.lock();
+            if (nbQueued == 0) {
+                sync.unlock();
+                return cancelled;
+            }
+            task_t task = pop();
+            sync.unlock();
+            task.runnable->cancelRun();
+            task.runnable.reset();
+            tasksDone(1);
+            ++cancelled;
+        }
+    }
+
+    void worker(size_t index)
+    {
+        worker_t &wrkr = workers[index];
+        WorkerContext::current = &wrkr;
+        options.apply(index, nbOptionFailures);
+        if (hooks.onStart) {
+            hooks.onStart(index);
+        }
+        sync.lock();
+        while (true) {
+            if (nbQueued == 0 && !wrkr.handoff.runnable && !stopped) {
+                wrkr.waiting = true;
+                idle[nbIdle++] = index;
+                ++nbIdleWorkers;
+                while (wrkr.waiting) {
+                    sync.wait(wrkr.cond);
+                }
+            }
+
+            task_t task;
+            if (wrkr.handoff.runnable) {
+                task = std::move(wrkr.handoff);
+            } else if (nbQueued > 0) {
+                task = pop();
+                ++nbActive;
+            } else if (stopped) {
+                break;
+            } else {
+                // NOTE: with Mesa semantics, another worker may have taken the
+                // task this one was woken up for
+                continue;
+            }
+            wrkr.current_token = std::move(task.token);
+            wrkr.cancelled.store(false, std::memory_order_relaxed);
+            sync.unlock();
+
+            if (wrkr.current_token.isCancelled()) {
+                task.runnable->cancelRun();
+            } else {
+                task.runnable->run();
+            }
+            // NOTE: destroyed before waitForDone() can return
+            task.runnable.reset();
+            --nbActive;
+            tasksDone(1);
+
+            sync.lock();
+        }
+        sync.unlock();
+        if (hooks.onStop) {
+            hooks.onStop(index);
+        }
+    }
+};
+
+#endif // STATICPOOL_H
@@ -0,0 +1,143 @@
+#ifndef SYNCPOLICY_H
+#define SYNCPOLICY_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <linux/futex.h>
+#include <mutex>
+#include <pcosynchro/pcohoaremonitor.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * The synchronization backends of BasicThreadPool. A backend is a monitor:
+ * lock()/unlock() delimit it, wait() releases it until the condition is
+ * signalled and signal() wakes up one thread waiting on the condition, doing
+ * nothing if there is none.
+ *
+ * The pool only relies on what all of them guarantee: a woken thread checks
+ * its predicate again, and nothing is expected to have run between signal()
+ * and the next statement of the signaller.
+ */
+
+/**
+ * Hoare semantics through PcoHoareMonitor: signal() hands the monitor over to
+ * the woken thread and waits for it to give it back.
+ */
+class HoareSync : private PcoHoareMonitor
+{
+public:
+    typedef PcoHoareMonitor::Condition Condition;
+
+    // Whether signal() gives the monitor up to the woken thread
+    static constexpr bool handsOver = true;
+
+    void lock() { monitorIn(); }
+    void unlock() { monitorOut(); }
+    void wait(Condition &cond) { PcoHoareMonitor::wait(cond); }
+    void signal(Condition &cond) { PcoHoareMonitor::signal(cond); }
+};
+
+/**
+ * Mesa semantics with std::mutex and std::condition_variable: the woken thread
+ * competes for the monitor once the signaller releases it.
+ */
+class MesaSync
+{
+public:
+    class Condition
+    {
+        friend class MesaSync;
+        std::condition_variable cond;
+    };
+
+    static constexpr bool handsOver = false;
+
+    void lock() { mutex.lock(); }
+    void unlock() { mutex.unlock(); }
+
+    void wait(Condition &cond)
+    {
+        std::unique_lock<std::mutex> lock(mutex, std::adopt_lock);
+        cond.cond.wait(lock);
+        // NOTE: the monitor stays locked when we leave
+        lock.release();
+    }
+
+    void signal(Condition &cond) { cond.cond.notify_one(); }
+
+private:
+    std::mutex mutex;
+};
+
+/**
+ * Mesa semantics straight on futex(2), which skips the bookkeeping of
+ * pthread. The lock is the three state mutex of Drepper's "Futexes Are
+ * Tricky" and a condition is a sequence number the waiters sleep on.
+ */
+class FutexSync
+{
+public:
+    class Condition
+    {
+        friend class FutexSync;
+        std::atomic<uint32_t> seq{0};
+    };
+
+    static constexpr bool handsOver = false;
+
+    void lock()
+    {
+        uint32_t expected = unlocked;
+        if (!state.compare_exchange_strong(expected, locked, std::memory_order_acquire)) {
+            lockContended();
+        }
+    }
+
+    void unlock()
+    {
+        if (state.exchange(unlocked, std::memory_order_release) == contended) {
+            futex(state, FUTEX_WAKE_PRIVATE, 1);
+        }
+    }
+
+    void wait(Condition &cond)
+    {
+        uint32_t seq = cond.seq.load(std::memory_order_relaxed);
+        unlock();
+        // NOTE: returns right away if a signal() changed seq meanwhile
+        futex(cond.seq, FUTEX_WAIT_PRIVATE, seq);
+        // NOTE: other woken waiters may be sleeping on the lock, it is taken as
+        // contended so that unlock() wakes them
+        lockContended();
+    }
+
+    void signal(Condition &cond)
+    {
+        cond.seq.fetch_add(1, std::memory_order_relaxed);
+        futex(cond.seq, FUTEX_WAKE_PRIVATE, 1);
+    }
+
+private:
+    static constexpr uint32_t unlocked = 0;
+    static constexpr uint32_t locked = 1;
+    static constexpr uint32_t contended = 2;
+
+    std::atomic<uint32_t> state{unlocked};
+
+    /* Takes the lock, marking it contended since others may be waiting. */
+    void lockContended()
+    {
+        while (state.exchange(contended, std::memory_order_acquire) != unlocked) {
+            futex(state, FUTEX_WAIT_PRIVATE, contended);
+        }
+    }
+
+    static void futex(std::atomic<uint32_t> &word, int op, uint32_t value)
+    {
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), op, value, nullptr, nullptr, 0);
+    }
+};
+
+#endif // SYNCPOLICY_H
@@ -0,0 +1,159 @@
+#ifndef TASKACCOUNTING_H
+#define TASKACCOUNTING_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "perfcounters.h"
+
+/**
+ * What the runnables sharing a key cost, see TaskAccounting. Durations are in
+ * nanoseconds.
+ */
+struct TaskAccount
+{
+    std::string key;
+    // The number of run() calls
+    uint64_t count = 0;
+    // The time spent in run() and the CPU time the worker used meanwhile
+    uint64_t wallNs = 0;
+    uint64_t cpuNs = 0;
+    // The counters of the worker over the run() calls, only filled when the
+    // accounting is enabled with them
+    PerfSample perf;
+
+    /* The time spent in run() off the CPU: blocked, sleeping or preempted. */
+    uint64_t offCpuNs() const { return wallNs > cpuNs ? wallNs - cpuNs : 0; }
+};
+
+/**
+ * Runtime enabled accounting of the wall and thread CPU time of the runnables,
+ * aggregated by Runnable::id(), or by the part of the id before a delimiter so
+ * that "resize:42" and "resize:43" add up under "resize".
+ *
+ * The table is split into shards with a mutex each, the workers recording
+ * different keys rarely end up on the same one. When disabled, the only cost
+ * left for the pool is a relaxed load of the enabled flag per runnable.
+ */
+class TaskAccounting
+{
+public:
+    static constexpr size_t nbShards = 16;
+
+    /**
+     * Starts recording. With perf counters, each worker also opens its own
+     * PerfCounters group and reads it around run(), which costs two read()
+     * system calls per runnable.
+     */
+    void enable(bool withPerfCounters = false)
+    {
+        perfCounters.store(withPerfCounters, std::memory_order_relaxed);
+        enabled.store(true, std::memory_order_relaxed);
+    }
+    void disable() { enabled.store(false, std::memory_order_relaxed); }
+    bool isEnabled() const { return enabled.load(std::memory_order_relaxed); }
+    bool hasPerfCounters() const { return perfCounters.load(std::memory_order_relaxed); }
+
+    /**
+     * Aggregates the ids by what comes before the first occurrence of the
+     * given delimiter, '\0' (the default) keeping the whole id. Only meant to
+     * be called while nothing is recorded.
+     */
+    void setDelimiter(char delimiter) { this->delimiter = delimiter; }
+
+    void record(const std::string &id, uint64_t wallNs, uint64_t cpuNs, const PerfSample &perf = {})
+    {
+        size_t end = delimiter ? id.find(delimiter) : std::string::npos;
+        std::string key = end == std::string::npos ? id : id.substr(0, end);
+
+        shard_t &shard = shards[std::hash<std::string>{}(key) % nbShards];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        TaskAccount &account = shard.accounts[key];
+        ++account.count;
+        account.wallNs += wallNs;
+        account.cpuNs += cpuNs;
+        account.perf += perf;
+    }
+
+    /* Returns every key recorded so far, the most CPU hungry first. */
+    std::vector<TaskAccount> snapshot() const
+    {
+        std::vector<TaskAccount> result;
+        for (const shard_t &shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (const auto &[key, account] : shard.accounts) {
+                result.push_back(account);
+                result.back().key = key;
+            }
+        }
+        std::sort(result.begin(), result.end(), [](const TaskAccount &a, const TaskAccount &b) {
+            return a.cpuNs > b.cpuNs;
+        });
+        return result;
+    }
+
+    /* Writes snapshot() as CSV, one line per key. */
+    void dumpCsv(std::ostream &out) const
+    {
+        out << "key,count,wall_ns,cpu_ns,off_cpu_ns,instructions,cycles,cache_misses,"
+               "context_switches,migrations\n";
+        for (const TaskAccount &account : snapshot()) {
+            out << account.key << "," << account.count << "," << account.wallNs << ","
+                << account.cpuNs << "," << account.offCpuNs() << "," << account.perf.instructions
+                << "," << account.perf.cycles << "," << account.perf.cacheMisses << ","
+                << account.perf.contextSwitches << "," << account.perf.migrations << "\n";
+        }
+    }
+
+    /* Same as above into the given file, returns false if it cannot be written. */
+    bool dumpCsv(const std::string &path) const
+    {
+        std::ofstream out(path);
+        if (!out) {
+            return false;
+        }
+        dumpCsv(out);
+        return static_cast<bool>(out);
+    }
+
+    void clear()
+    {
+        for (shard_t &shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.accounts.clear();
+        }
+    }
+
+    /* Returns the CPU time used by the calling thread. */
+    static uint64_t threadCpuNs()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+private:
+    // NOTE: aligned so that two shards never share a cache line
+    struct alignas(64) shard_t
+    {
+        mutable std::mutex mutex;
+        std::unordered_map<std::string, TaskAccount> accounts;
+    };
+
+    std::atomic<bool> enabled{false};
+    std::atomic<bool> perfCounters{false};
+    char delimiter = '\0';
+    std::array<shard_t, nbShards> shards;
+};
+
+#endif // TASKACCOUNTING_H
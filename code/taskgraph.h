@@ -0,0 +1,298 @@
+#ifndef TASKGRAPH_H
+#define TASKGRAPH_H
+
+#include <atomic>
+#include <cassert>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <pcosynchro/pcohoaremonitor.h>
+#include <utility>
+#include <vector>
+
+#include "objectpool.h"
+#include "threadpool.h"
+
+/**
+ * A dependency graph of tasks run over a pool. A node becomes runnable once
+ * all of its predecessors finished.
+ *
+ * The graph is built once and can then be run any number of times: the nodes,
+ * the edges and the roots are kept between runs and only the predecessor
+ * counters are reset. The only allocations left per run are the small
+ * runnables handed over to the pool.
+ *
+ * When a node finishes, the first successor it made ready is run right away by
+ * the same worker, the other ones are given to the pool. Nodes refused by the
+ * pool are run by the thread that tried to submit them, once that thread is
+ * done with the nodes it is running.
+ */
+class TaskGraph
+{
+public:
+    typedef size_t NodeId;
+
+    TaskGraph()
+        : impl(std::make_shared<Impl>())
+    {}
+
+    /**
+     * Adds a node running the given runnable. The runnable is kept by the graph
+     * and run() once per run of the graph.
+     */
+    NodeId addNode(std::unique_ptr<Runnable> runnable)
+    {
+        return impl->addNode(std::move(runnable), {});
+    }
+
+    /**
+     * Adds a node calling the given callable once per run of the graph.
+     */
+    NodeId addNode(std::function<void()> fn) { return impl->addNode(nullptr, std::move(fn)); }
+
+    /**
+     * Makes the node after wait for the node before to finish.
+     */
+    void addEdge(NodeId before, NodeId after) { impl->addEdge(before, after); }
+
+    /* Returns the number of nodes in the graph. */
+    size_t size() const { return impl->size(); }
+
+    /**
+     * Runs every node of the graph once and returns when they are all finished.
+     * A graph can be run several times but not concurrently.
+     */
+    template<typename Pool>
+    void run(Pool &pool)
+    {
+        impl->run([&pool](std::unique_ptr<Runnable> runnable) {
+            return pool.start(std::move(runnable));
+        });
+    }
+
+private:
+    static constexpr NodeId none = std::numeric_limits<NodeId>::max();
+
+    struct node_t
+    {
+        // Either the runnable or the callable is set
+        std::unique_ptr<Runnable> runnable;
+        std::function<void()> fn;
+        std::vector<NodeId> successors;
+        // The number of edges leading to this node
+        size_t nbPredecessors = 0;
+        // The number of predecessors that didn't finish yet in the current run
+        std::atomic<size_t> pending{0};
+    };
+
+    /**
+     * The state shared with the runnables. They keep it alive since the worker
+     * finishing the last node is still within the monitor when run() wakes up
+     * and may return.
+     */
+    class Impl : public PcoHoareMonitor, public std::enable_shared_from_this<Impl>
+    {
+    public:
+        NodeId addNode(std::unique_ptr<Runnable> runnable, std::function<void()> fn)
+        {
+            node_t &node = nodes.emplace_back();
+            node.runnable = std::move(runnable);
+            node.fn = std::move(fn);
+            dirty = true;
+            return nodes.size() - 1;
+        }
+
+        void addEdge(NodeId before, NodeId after)
+        {
+            assert(before < nodes.size() && after < nodes.size() && before != after);
+            nodes[before].successors.push_back(after);
+            ++nodes[after].nbPredecessors;
+            dirty = true;
+        }
+
+        size_t size() const { return nodes.size(); }
+
+        void run(std::function<bool(std::unique_ptr<Runnable>)> submitFn)
+        {
+            if (nodes.empty()) {
+                return;
+            }
+            if (dirty) {
+                findRoots();
+            }
+
+            for (auto &node : nodes) {
+                node.pending.store(node.nbPredecessors, std::memory_order_relaxed);
+            }
+            remaining.store(nodes.size(), std::memory_order_relaxed);
+            submit = std::move(submitFn);
+
+            for (NodeId root : roots) {
+                if (!trySubmit(root)) {
+                    execute(root);
+                }
+            }
+
+            monitorIn();
+            while (remaining.load() > 0) {
+                wait(done);
+            }
+            monitorOut();
+        }
+
+        /**
+         * Runs the given node and then, as long as it makes one ready, one of
+         * its successors.
+         */
+        void execute(NodeId id)
+        {
+            while (id != none) {
+                node_t &node = nodes[id];
+                if (node.runnable) {
+                    node.runnable->run();
+                } else {
+                    node.fn();
+                }
+
+                id = none;
+                for (NodeId successor : node.successors) {
+                    if (nodes[successor].pending.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+                        continue;
+                    }
+                    if (id == none) {
+                        id = successor;
+                    } else if (!trySubmit(successor)) {
+                        executeRefused(shared_from_this(), successor);
+                    }
+                }
+
+                if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    monitorIn();
+                    signal(done);
+                    monitorOut();
+                }
+            }
+        }
+
+        /**
+         * Runs a node refused by the pool on the calling thread. A thread
+         * already running refused nodes defers it until done, rather than
+         * recursing once per node of a run of refusals.
+         */
+        static void executeRefused(std::shared_ptr<Impl> graph, NodeId id)
+        {
+            struct refused_t
+            {
+                std::shared_ptr<Impl> graph;
+                NodeId id;
+            };
+            // The nodes deferred by the outermost call on the thread, if any
+            static thread_local std::vector<refused_t> *deferred = nullptr;
+
+            if (deferred) {
+                deferred->push_back({std::move(graph), id});
+                return;
+            }
+            std::vector<refused_t> pending;
+            pending.push_back({std::move(graph), id});
+            deferred = &pending;
+            for (size_t i = 0; i < pending.size(); ++i) {
+                refused_t next = std::move(pending[i]);
+                next.graph->execute(next.id);
+            }
+            deferred = nullptr;
+        }
+
+        // Set while the pool may synchronously refuse one of our runnables
+        static inline thread_local bool submitting = false;
+
+    private:
+        // NOTE: a deque since the atomics cannot be moved around on growth
+        std::deque<node_t> nodes;
+        // The nodes without predecessors
+        std::vector<NodeId> roots;
+        // Whether roots needs to be recomputed
+        bool dirty = false;
+        // The number of nodes left to run in the current run
+        std::atomic<size_t> remaining{0};
+
+        // Gives a runnable to the pool given to run()
+        std::function<bool(std::unique_ptr<Runnable>)> submit;
+
+        // Signaled when the last node of a run is finished
+        Condition done;
+
+        bool trySubmit(NodeId id)
+        {
+            submitting = true;
+            bool accepted = submit(std::make_unique<NodeRunnable>(shared_from_this(), id));
+            submitting = false;
+            return accepted;
+        }
+
+        /**
+         * Computes the roots and checks that the graph has no cycle, which would
+         * make run() wait forever.
+         */
+        void findRoots()
+        {
+            roots.clear();
+            std::vector<size_t> pending(nodes.size());
+            std::vector<NodeId> ready;
+            for (NodeId id = 0; id < nodes.size(); ++id) {
+                pending[id] = nodes[id].nbPredecessors;
+                if (pending[id] == 0) {
+                    roots.push_back(id);
+                    ready.push_back(id);
+                }
+            }
+
+            size_t visited = 0;
+            while (!ready.empty()) {
+                NodeId id = ready.back();
+                ready.pop_back();
+                ++visited;
+                for (NodeId successor : nodes[id].successors) {
+                    if (--pending[successor] == 0) {
+                        ready.push_back(successor);
+                    }
+                }
+            }
+            assert(visited == nodes.size() && "the task graph contains a cycle");
+
+            dirty = false;
+        }
+    };
+
+    // NOTE: one is created per node and run, they are recycled
+    class NodeRunnable : public Runnable, public Recyclable<NodeRunnable>
+    {
+    public:
+        NodeRunnable(std::shared_ptr<Impl> graph, NodeId node)
+            : graph(std::move(graph))
+            , node(node)
+        {}
+
+        void run() override { graph->execute(node); }
+
+        void cancelRun() override
+        {
+            // NOTE: a synchronous refusal is handled by the submitter, any other
+            // cancellation still has to run the node or run() never returns.
+            if (!Impl::submitting) {
+                graph->execute(node);
+            }
+        }
+
+        std::string id() override { return "taskgraph"; }
+
+    private:
+        std::shared_ptr<Impl> graph;
+        NodeId node;
+    };
+
+    std::shared_ptr<Impl> impl;
+};
+
+#endif // TASKGRAPH_H
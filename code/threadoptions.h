@@ -0,0 +1,142 @@
+#ifndef THREADOPTIONS_H
+#define THREADOPTIONS_H
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <sys/resource.h>
+#include <unistd.h>
+
+/**
+ * The scheduling class of the workers:
+ * - Normal: SCHED_OTHER, what every thread gets by default
+ * - Batch: SCHED_BATCH, CPU bound work that gives way to the interactive threads
+ * - Idle: SCHED_IDLE, only runs on the CPUs nothing else wants
+ */
+enum class SchedClass { Normal, Batch, Idle };
+
+/**
+ * The OS level settings of the workers of a pool, given to its constructor.
+ * A background pool set to SchedClass::Idle or a high nice value yields the
+ * CPUs to a latency critical one without any coordination between the two.
+ * The defaults leave the threads as the process creates them.
+ */
+struct ThreadOptions
+{
+    // Names the workers "pool-<name>-<id>" for top, perf and the debuggers,
+    // cut to the 15 characters Linux keeps. Unnamed when empty.
+    std::string name;
+    // The stack size of the workers, the default of the process, 8 MB
+    // usually, when 0
+    size_t stackSize = 0;
+    SchedClass schedClass = SchedClass::Normal;
+    // The nice value of the workers, left to the one of the process when 0.
+    // Going below the one of the process takes CAP_SYS_NICE.
+    int nice = 0;
+
+    /**
+     * Creates a thread through the given function with the stack size set,
+     * counting in failures a stack size that couldn't be set.
+     *
+     * PcoThread takes no attributes, so the stack size goes through the
+     * default attributes of the process, restored right after. Every thread
+     * of the pools is created under stackMutex(), the workers left to the
+     * default stack size too, which keeps the pools from restoring each
+     * other's stack size or from starting a thread with the one of another
+     * pool. The threads created meanwhile by anything else than a pool still
+     * get the stack size of the worker.
+     */
+    template<typename Create>
+    auto createThread(Create &&create, std::atomic<size_t> &failures) const
+    {
+        std::lock_guard<std::mutex> lock(stackMutex());
+        if (!stackSize) {
+            return create();
+        }
+
+        // NOTE: restores the defaults even if create() throws
+        struct Restore
+        {
+            pthread_attr_t previous;
+            bool changed = false;
+
+            ~Restore()
+            {
+                if (changed) {
+                    pthread_setattr_default_np(&previous);
+                    pthread_attr_destroy(&previous);
+                }
+            }
+        } restore;
+
+        if (pthread_getattr_default_np(&restore.previous) == 0) {
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            restore.changed
+                = pthread_attr_setstacksize(&attr, std::max<size_t>(stackSize, PTHREAD_STACK_MIN))
+                      == 0
+                  && pthread_setattr_default_np(&attr) == 0;
+            pthread_attr_destroy(&attr);
+            if (!restore.changed) {
+                pthread_attr_destroy(&restore.previous);
+            }
+        }
+        if (!restore.changed) {
+            ++failures;
+        }
+        return create();
+    }
+
+    /**
+     * Creates a thread of a pool other than a worker, the timer or the
+     * watchdog, through the given function with the default attributes of
+     * the process, see createThread().
+     */
+    template<typename Create>
+    static auto createDefault(Create &&create)
+    {
+        std::lock_guard<std::mutex> lock(stackMutex());
+        return create();
+    }
+
+    /**
+     * Applies the name, the scheduling class and the nice value to the
+     * calling worker. The settings the process isn't allowed to make are
+     * left out and counted in failures.
+     */
+    void apply(size_t id, std::atomic<size_t> &failures) const
+    {
+        if (!name.empty()) {
+            std::string full = "pool-" + name + "-" + std::to_string(id);
+            if (pthread_setname_np(pthread_self(), full.substr(0, 15).c_str()) != 0) {
+                ++failures;
+            }
+        }
+        if (schedClass != SchedClass::Normal) {
+            sched_param param{};
+            int policy = schedClass == SchedClass::Batch ? SCHED_BATCH : SCHED_IDLE;
+            if (pthread_setschedparam(pthread_self(), policy, &param) != 0) {
+                ++failures;
+            }
+        }
+        // NOTE: on Linux, the nice value belongs to the thread, not to the
+        // whole process
+        if (nice && setpriority(PRIO_PROCESS, gettid(), nice) != 0) {
+            ++failures;
+        }
+    }
+
+private:
+    static std::mutex &stackMutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+};
+
+#endif // THREADOPTIONS_H
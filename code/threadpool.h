@@ -1,28 +1,54 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <list>
 #include <map>
 #include <memory>
-#include <pcosynchro/pcohoaremonitor.h>
-#include <pcosynchro/pcologger.h>
+#include <memory_resource>
+#include <optional>
+#include <mutex>
 #include <pcosynchro/pcomanager.h>
 #include <pcosynchro/pcosemaphore.h>
 #include <pcosynchro/pcothread.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
 #include <thread>
+#include <unordered_map>
 #include <utility>
-#include <queue>
+#include <vector>
+
+#include "asynclogger.h"
+#include "histogram.h"
+#include "numa.h"
+#include "poolclock.h"
+#include "poolpolicies.h"
+#include "syncpolicy.h"
+#include "taskaccounting.h"
+#include "threadoptions.h"
+#include "tracing.h"
 
-// NOTE: could wrap this in #ifdef DEBUG
+// NOTE: could wrap this in #ifdef DEBUG. The logs go through AsyncLog so
+// that they don't serialize the workers.
 #define LOG_TIMER 0
 #define LOG_DEL 0
 #define LOG_WORK 0
 #define LOG_IN_OUT 0
 #define LOG_TASKS 0
 
-#if LOG_IN_OUT
-#include <atomic>
+// Measures how long each call site waits to enter the monitor and holds it,
+// see ThreadPool::monitorProfile()
+#ifndef PROFILE_MONITOR
+#define PROFILE_MONITOR 0
 #endif
 
 class Runnable
@@ -34,68 +60,371 @@ public:
     virtual std::string id() = 0;
 };
 
-class ThreadPool : public PcoHoareMonitor
+/**
+ * A flag shared between whoever submits a runnable and the pool. Cancelling it
+ * before the runnable is dequeued makes the pool call cancelRun() instead of
+ * run(), cancelling it afterwards is visible through ThreadPool::isCancelled().
+ * A default constructed token is never cancelled and costs nothing.
+ */
+class CancellationToken
 {
 public:
-    ThreadPool(int maxThreadCount, int maxNbWaiting, std::chrono::milliseconds idleTimeout)
+    CancellationToken() = default;
+
+    /* Returns a token that can be cancelled. */
+    static CancellationToken create()
+    {
+        CancellationToken token;
+        token.flag = std::make_shared<std::atomic<bool>>(false);
+        return token;
+    }
+
+    void cancel()
+    {
+        if (flag) {
+            flag->store(true, std::memory_order_relaxed);
+        }
+    }
+
+    bool isCancelled() const { return flag && flag->load(std::memory_order_relaxed); }
+
+private:
+    std::shared_ptr<std::atomic<bool>> flag;
+};
+
+/**
+ * What ThreadPool::shutdown() does with the runnables left in the queue.
+ */
+enum class ShutdownMode { Drain, CancelPending, Deadline };
+
+struct ShutdownResult
+{
+    // The number of queued runnables that were run during the shutdown
+    size_t drained = 0;
+    // The number of queued runnables that were cancelled
+    size_t cancelled = 0;
+    // Whether the deadline was reached before the queue was drained
+    bool timedOut = false;
+};
+
+/**
+ * A snapshot of the activity of a pool, see ThreadPool::stats(). Durations
+ * are in nanoseconds.
+ */
+struct ThreadPoolStats
+{
+    struct Worker
+    {
+        size_t id = 0;
+        // The number of runnables run
+        uint64_t tasks = 0;
+        // The time spent running them
+        uint64_t busyNs = 0;
+        // The time spent waiting for one
+        uint64_t idleNs = 0;
+    };
+
+    // The workers currently alive
+    std::vector<Worker> workers;
+    // Totals over every worker the pool ever had, retired ones included
+    uint64_t tasks = 0;
+    uint64_t busyNs = 0;
+    uint64_t idleNs = 0;
+    // The number of runnables in the queue and the most there ever was
+    size_t queueDepth = 0;
+    size_t queueHighWater = 0;
+    // The number of runnables refused by start()
+    uint64_t rejected = 0;
+    // The time the runnables spent in the queue and in run()
+    Histogram queueWait;
+    Histogram runTime;
+
+    /* Returns the fraction of their lifetime the workers spent running tasks. */
+    double utilization() const
+    {
+        return busyNs + idleNs ? static_cast<double>(busyNs) / (busyNs + idleNs) : 0.0;
+    }
+};
+
+/**
+ * What a worker is doing, see ThreadPool::workerStates().
+ */
+struct WorkerState
+{
+    size_t id = 0;
+    // Whether the worker is running a runnable, task and elapsed being empty
+    // otherwise
+    bool running = false;
+    // The id() of the runnable, truncated to ThreadPool::maxStateIdLength
+    std::string task;
+    // How long the runnable has been running
+    std::chrono::nanoseconds elapsed{0};
+    // The number of runnables the worker started, the running one included
+    uint64_t started = 0;
+};
+
+/**
+ * Called on the thread of each worker with its id: onStart before it looks
+ * for its first runnable, onStop right before it exits, which is before the
+ * timer or shutdown() join it. Meant to set up and tear down thread local
+ * state off the runnables. Either may be empty.
+ */
+struct WorkerHooks
+{
+    std::function<void(size_t)> onStart;
+    std::function<void(size_t)> onStop;
+};
+
+/**
+ * How the workers are pinned to the CPUs, see ThreadPool::setPlacement().
+ * - None: not at all, the scheduler moves them around
+ * - Node: each worker to the CPUs of a NUMA node, the nodes taken in turn
+ * - Core: each worker to a single CPU, the CPUs taken in turn
+ */
+enum class Pinning { None, Node, Core };
+
+struct Placement
+{
+    Pinning pinning = Pinning::None;
+    // The CPUs the workers may run on, every CPU when empty
+    std::vector<int> cpus;
+};
+
+/**
+ * The places where ThreadPool enters its monitor. WorkerPark is the worker
+ * getting the monitor back after waiting for a task.
+ */
+enum class MonitorSite { Start, WorkerDequeue, WorkerPark, Timer, Shutdown, Cancel, Stats };
+
+constexpr size_t nbMonitorSites = 7;
+
+/**
+ * How a call site of the monitor fared, see ThreadPool::monitorProfile().
+ * Durations are in nanoseconds.
+ */
+struct MonitorSiteProfile
+{
+    MonitorSite site;
+    // How long the site waited to enter the monitor, once per entry
+    Histogram acquire;
+    // How long the site held the monitor, once per release
+    Histogram hold;
+
+    /**
+     * The share of the time spent around the monitor that went into waiting
+     * to get in. Close to 1 means that the site mostly queues behind others.
+     */
+    double contentionRatio() const
+    {
+        uint64_t waited = acquire.valueSum();
+        uint64_t held = hold.valueSum();
+        return waited + held ? static_cast<double>(waited) / (waited + held) : 0.0;
+    }
+};
+
+/**
+ * The part of a worker that its runnables reach through the static members of
+ * the pool, ThreadPool::isCancelled() and ThreadPool::currentArena(). It
+ * doesn't depend on the policies, so that these also answer for the runnables
+ * of the other BasicThreadPool instantiations.
+ */
+struct WorkerContext
+{
+    // The token of the task being run, only written within the monitor
+    CancellationToken current_token;
+    // Set by cancel()/cancelGroup() when they match the task being run
+    std::atomic<bool> cancelled{false};
+    // The scratch arena of the worker, if any, only accessed by the worker
+    std::optional<std::pmr::monotonic_buffer_resource> arena;
+
+    // The worker run by the current thread, if any
+    static inline thread_local WorkerContext *current = nullptr;
+};
+
+/**
+ * The pool, specialized at compile time by the policies of poolpolicies.h and
+ * by the sync backend of its monitor, see syncpolicy.h. ThreadPool enables
+ * everything on PcoHoareMonitor.
+ */
+template<
+    typename QueuePolicy = IndexedQueue,
+    typename SyncPolicy = HoareSync,
+    typename GrowthPolicy = DynamicGrowth,
+    typename StatsPolicy = FullStats>
+class BasicThreadPool
+{
+public:
+    /**
+     * The idle timeouts follow the given clock, a ManualClock making them
+     * deterministic. Everything else (stats, waitForDone(), the deadline of
+     * shutdown()) stays in real time. With FixedGrowth, the maxThreadCount
+     * workers are all started here.
+     */
+    BasicThreadPool(
+        int maxThreadCount,
+        int maxNbWaiting,
+        std::chrono::milliseconds idleTimeout,
+        std::shared_ptr<PoolClock> clock = std::make_shared<SteadyClock>())
+        : BasicThreadPool(maxThreadCount, maxNbWaiting, idleTimeout, WorkerHooks{}, std::move(clock))
+    {}
+
+    /* Same as above, each worker calling the given hooks. */
+    BasicThreadPool(
+        int maxThreadCount,
+        int maxNbWaiting,
+        std::chrono::milliseconds idleTimeout,
+        WorkerHooks hooks,
+        std::shared_ptr<PoolClock> clock = std::make_shared<SteadyClock>())
+        : BasicThreadPool(
+              maxThreadCount,
+              maxNbWaiting,
+              idleTimeout,
+              ThreadOptions{},
+              std::move(hooks),
+              std::move(clock))
+    {}
+
+    /* Same as above, the workers being set up as the given options say. */
+    BasicThreadPool(
+        int maxThreadCount,
+        int maxNbWaiting,
+        std::chrono::milliseconds idleTimeout,
+        ThreadOptions options,
+        WorkerHooks hooks = {},
+        std::shared_ptr<PoolClock> clock = std::make_shared<SteadyClock>())
         : maxThreadCount(maxThreadCount)
         , maxNbWaiting(maxNbWaiting)
+        , nbAvailable(0)
         , idleTimeout(idleTimeout)
         , threads()
-        , queue()
-        , nbAvailable(0)
-        , timer_thread(std::make_unique<PcoThread>(&ThreadPool::timer, this))
-    {}
+        , queues(NumaTopology::system().nodeCount())
+        , options(std::move(options))
+        , hooks(std::move(hooks))
+        , clock(std::move(clock))
+        , slots(std::make_unique<worker_slot_t[]>(maxThreadCount))
+        , timer_thread(
+              GrowthPolicy::fixed ? nullptr : ThreadOptions::createDefault([this] {
+                  return std::make_unique<PcoThread>(&BasicThreadPool::timer, this);
+              }))
+    {
+        if constexpr (GrowthPolicy::fixed) {
+            monitorIn(MonitorSite::Start);
+            while (threads.size() < this->maxThreadCount) {
+                spawn();
+            }
+            monitorOut();
+        }
+    }
 
-    ~ThreadPool()
+    ~BasicThreadPool() { shutdown(ShutdownMode::Drain); }
+
+    /**
+     * Stops the pool, start() refuses every runnable from then on. Depending
+     * on the mode, the runnables still in the queue are:
+     * - Drain: all run, which is what the destructor does
+     * - CancelPending: all cancelled, only the running ones are waited for
+     * - Deadline: run until the deadline is reached, the rest being cancelled
+     * Returns once every worker is joined, which makes destroying the pool
+     * cheap afterwards. Does nothing if the pool is already shut down.
+     */
+    ShutdownResult shutdown(
+        ShutdownMode mode = ShutdownMode::Drain,
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max())
     {
-        // NOTE: we cannot call join within a monitor and we don't need to be
-        // within the monitor to stop the timer.
-        timer_thread->requestStop();
-        timer_thread->join();
+        monitorIn(MonitorSite::Shutdown);
+        if (stopped) {
+            monitorOut();
+            return {};
+        }
+        stopped = true;
+        size_t queued = nbQueued;
+        monitorOut();
+
+        ShutdownResult result;
+        if (mode == ShutdownMode::CancelPending) {
+            result.cancelled = cancelPending();
+        }
 
-        monitorIn();
+        monitorIn(MonitorSite::Shutdown);
 #if LOG_DEL > 1
-        PcoLogger() << "[~TheadPool] begin" << std::endl;
+        AsyncLog() << "[shutdown] begin" << std::endl;
 #endif
 
         for (auto it = threads.begin(); it != threads.end(); ++it) {
 #if LOG_DEL > 2
-            PcoLogger() << "[~TheadPool] requestStop on: " << it->first << std::endl;
+            AsyncLog() << "[shutdown] requestStop on: " << it->first << std::endl;
 #endif
             it->second.thread->requestStop();
-            // doesn't matter if the worker is waiting or not, signal() will
-            // check by itself.
-            signal(*it->second.cond);
+            // NOTE: the other ones check the stop request before they park
+            if (it->second.waiting) {
+                wake(it->first);
+            }
         }
 
 #if LOG_DEL > 1
-        PcoLogger() << "[~TheadPool] middle" << std::endl;
-        PcoLogger() << "[~TheadPool] nb threads: " << threads.size() << std::endl;
+        AsyncLog() << "[shutdown] middle" << std::endl;
+        AsyncLog() << "[shutdown] nb threads: " << threads.size() << std::endl;
 
-        PcoLogger() << "[~TheadPool] queue.size(): " << queue.size() << std::endl;
-        PcoLogger() << "[~TheadPool] nbAvailable: " << nbAvailable << std::endl;
+        AsyncLog() << "[shutdown] nbQueued: " << nbQueued << std::endl;
+        AsyncLog() << "[shutdown] nbAvailable: " << nbAvailable << std::endl;
 #endif
 
         monitorOut();
 
+        // NOTE: a deadline of time_point::max() is a drain, which also keeps it
+        // away from wait_until()
+        if (mode == ShutdownMode::Deadline
+            && deadline != std::chrono::steady_clock::time_point::max()) {
+            std::unique_lock<std::mutex> lock(idleMutex);
+            if (!idleCond.wait_until(lock, deadline, [this] { return nbQueued == 0; })) {
+                lock.unlock();
+                result.cancelled = cancelPending();
+                result.timedOut = true;
+            }
+        }
+
+        // NOTE: we cannot call join within a monitor and we don't need to be
+        // within the monitor to stop the timer. It is only stopped now so that
+        // it keeps timing out the workers while the queue drains.
+        if constexpr (!GrowthPolicy::fixed) {
+            timer_thread->requestStop();
+            timerWake = true;
+            clock->notify();
+            timer_thread->join();
+        }
+        if constexpr (StatsPolicy::enabled) {
+            stopWatchdog();
+        }
+
 #if LOG_IN_OUT
-        PcoLogger() << "[~TheadPool] nb in/out: " << in << "/" << out << std::endl;
+        AsyncLog() << "[shutdown] nb in/out: " << in << "/" << out << std::endl;
 #endif
 
+        // NOTE: the timer is stopped and start() refuses everything, nobody
+        // else touches the map anymore
         for (auto it = threads.begin(); it != threads.end(); ++it) {
 #if LOG_DEL > 2
-            PcoLogger() << "[~TheadPool] joining thread: " << it->first << std::endl;
+            AsyncLog() << "[shutdown] joining thread: " << it->first << std::endl;
 #endif
             it->second.thread->join();
+            retire(it->second);
+            it->second.slot->used.store(false, std::memory_order_relaxed);
         }
+        threads.clear();
+        nbThreads = 0;
+
+        result.drained = queued > result.cancelled ? queued - result.cancelled : 0;
 #if LOG_TASKS
-        PcoLogger() << "[~TheadPool] tasks accepted/refused/executed: " << accepted << "/"
+        AsyncLog() << "[shutdown] tasks accepted/refused/executed: " << accepted << "/"
                     << refused << "/" << executed << std::endl;
 #endif
 #if LOG_DEL
-        PcoLogger() << "[~TheadPool] end" << std::endl;
+        AsyncLog() << "[shutdown] end" << std::endl;
 #endif
+        // NOTE: whatever the runnables and the pool logged is out before the
+        // pool is gone
+        AsyncLogger::instance().flush();
+        return result;
     }
 
     /*
@@ -105,15 +434,25 @@ public:
      * pool is at max capacity and there are less than maxNbWaiting threads waiting,
      * block the caller until a thread becomes available again, and else do not run the runnable.
      * If the runnable has been started, returns true, and else (the last case), return false.
+     * The runnable goes to the workers of the given NUMA node first, the node
+     * the caller runs on by default, see setPlacement().
      */
-    bool start(std::unique_ptr<Runnable> runnable)
+    bool start(
+        std::unique_ptr<Runnable> runnable,
+        CancellationToken token = {},
+        std::string group = {},
+        int node = -1)
     {
-        monitorIn();
-        if (queue.size() >= maxNbWaiting) {
-// No place left
+        size_t home = node >= 0 ? node % queues.size() : topology.currentNode();
+        monitorIn(MonitorSite::Start);
+        if (stopped || nbQueued >= maxNbWaiting) {
+// No place left or shut down
 #if LOG_TASKS
             ++refused;
 #endif
+            if constexpr (StatsPolicy::enabled) {
+                ++nbRejected;
+            }
             monitorOut();
             runnable->cancelRun();
             return false;
@@ -122,38 +461,41 @@ public:
 #if LOG_TASKS
         ++accepted;
 #endif
+        task_t task{
+            .runnable = std::move(runnable),
+            .id = {},
+            .group = std::move(group),
+            .token = std::move(token),
+            .node = home};
+
+        if (nbQueued == 0 && nbSpinning == 0 && nbAvailable) {
+            // NOTE: nothing is waiting before this task, it goes straight to
+            // the worker parked last, which doesn't have to look at the queue
+            handOff(std::move(task));
+            monitorOut();
+            return true;
+        }
+
         // Even if we create a new thread the queue is still the way that's used
         // to give the task to the worker.
-        queue.push(std::move(runnable));
+        push(std::move(task));
 
-        if (nbAvailable) {
+        if (nbQueued <= nbSpinning) {
+            // NOTE: a spinning worker sees the task without being woken up and
+            // only decrements nbSpinning within the monitor, so it will take it
+        } else if (nbAvailable) {
             // NOTE: A worker is available
-            for (auto it = threads.begin(); it != threads.end(); ++it) {
-                if (it->second.waiting) {
-                    signal(*it->second.cond);
-                    break;
-                }
+            wake(idleWorker(home));
+        } else if constexpr (!GrowthPolicy::fixed) {
+            if (threads.size() < maxThreadCount) {
+                // NOTE: We can still create more threads
+                spawn();
             }
-        } else if (threads.size() < maxThreadCount) {
-            // NOTE: We can still create more threads
-            size_t id = next_thread_id++;
-            threads.emplace(
-                id,
-                worker_t{
-                    .thread = std::make_shared<PcoThread>(&ThreadPool::worker, this, id),
-                    .cond = std::make_shared<Condition>(),
-                    .waiting = false,
-                    .timeout = {},
-                    .timed_out = false});
         }
 
         // NOTE: default action is just queuing since a worker will take the
         // job when available
 
-        // NOTE: the reason why we fail the 4th test might be due to the fact
-        // that workers that finished their task are in competition with whichever
-        // thread tries to add a new task when it comes to securing the mutex
-
         monitorOut();
         return true;
     }
@@ -161,25 +503,297 @@ public:
     /* Returns the number of currently running threads. They do not need to be executing a task,
      * just to be alive. (The watchdog isn't accounted for)
      */
-    size_t currentNbThreads() { return threads.size(); }
+    size_t currentNbThreads() { return nbThreads; }
+
+    /* Returns the number of runnables waiting in the queue. Lock-free. */
+    size_t pendingCount() { return nbQueued; }
+
+    /* Returns the number of runnables being run. Lock-free. */
+    size_t activeCount() { return nbActive; }
+
+    /* Returns the number of workers waiting for a runnable. Lock-free. */
+    size_t idleCount() { return nbAvailable; }
+
+    /**
+     * Returns the number of settings of the ThreadOptions that the workers
+     * couldn't apply, a nice value the process may not set for instance.
+     * Lock-free.
+     */
+    size_t threadOptionFailures() { return nbOptionFailures; }
+
+    /**
+     * Returns a snapshot of the pool activity. The counters are kept per worker
+     * and only aggregated here, calling it doesn't slow the workers down.
+     */
+    ThreadPoolStats stats()
+    {
+        static_assert(StatsPolicy::enabled, "stats() needs FullStats");
+        monitorIn(MonitorSite::Stats);
+        ThreadPoolStats result = retired;
+        for (auto it = threads.begin(); it != threads.end(); ++it) {
+            const worker_stats_t &counters = it->second.stats;
+            ThreadPoolStats::Worker &wrkr = result.workers.emplace_back();
+            wrkr.id = it->first;
+            wrkr.tasks = counters.tasks.load(std::memory_order_relaxed);
+            wrkr.busyNs = counters.busyNs.load(std::memory_order_relaxed);
+            wrkr.idleNs = counters.idleNs.load(std::memory_order_relaxed);
+            result.tasks += wrkr.tasks;
+            result.busyNs += wrkr.busyNs;
+            result.idleNs += wrkr.idleNs;
+            counters.queueWait.mergeInto(result.queueWait);
+            counters.runTime.mergeInto(result.runTime);
+        }
+        result.queueDepth = nbQueued;
+        result.queueHighWater = queueHighWater;
+        result.rejected = nbRejected;
+        monitorOut();
+        return result;
+    }
+
+    /**
+     * Sets how the idle workers wait for the next runnable. A worker finding
+     * the queue empty first spins (pause instructions, then yields) as long
+     * as twice the average gap it recently saw between two runnables, up to
+     * maxSpin, and only then parks. Gaps longer than maxSpin don't spin at
+     * all, and no more than maxSpinners workers spin at the same time, 0
+     * disabling the spinning. By default half of the cores may spin, for up
+     * to 50 us.
+     */
+    void setIdleSpin(size_t maxSpinners, std::chrono::nanoseconds maxSpin)
+    {
+        monitorIn(MonitorSite::Start);
+        this->maxSpinners = maxSpinners;
+        maxSpinNs = maxSpin.count();
+        monitorOut();
+    }
+
+    /**
+     * Gives every worker a scratch arena of the given size, see
+     * currentArena(). 0, the default, goes without. Each worker picks the new
+     * size up before its next runnable.
+     */
+    void setArenaSize(size_t bytes) { arenaSize.store(bytes, std::memory_order_relaxed); }
+
+    /**
+     * Sets how the workers are pinned, each worker applying it before its
+     * next runnable. A pinned worker belongs to the NUMA node of its CPUs,
+     * an unpinned one to the node it last ran on. Either way, it takes the
+     * runnables started for its node first, then the ones of the nearest
+     * nodes. The workers are placed by their index, below maxThreadCount, so
+     * that a worker replacing a timed out one gets the same CPUs. Only the
+     * CPUs the process was allowed when the topology was read are used, all
+     * of them when none of the given ones is.
+     */
+    void setPlacement(Placement placement)
+    {
+        monitorIn(MonitorSite::Start);
+        this->placement = std::move(placement);
+        ++placementVersion;
+        monitorOut();
+    }
+
+    /**
+     * Returns the number of times a worker failed to pin itself, in which
+     * case it runs unpinned until the next setPlacement(). Lock-free.
+     */
+    size_t placementFailures() { return nbPinFailures; }
+
+    /**
+     * Returns what each worker is doing. Doesn't take the monitor, so that it
+     * still answers when the pool is wedged, the state of each worker being
+     * consistent but not taken at the same time as the other ones.
+     */
+    std::vector<WorkerState> workerStates()
+    {
+        static_assert(StatsPolicy::enabled, "workerStates() needs FullStats");
+        std::vector<WorkerState> states;
+        uint64_t now = nowNs();
+        for (size_t i = 0; i < maxThreadCount; ++i) {
+            if (slots[i].used.load(std::memory_order_relaxed)) {
+                states.push_back(slots[i].read(now));
+            }
+        }
+        return states;
+    }
+
+    /**
+     * Starts a watchdog thread calling the handler, from that thread, once for
+     * every runnable running for longer than the threshold. Without handler
+     * the stalls are logged. Replaces the previous watchdog if any. The
+     * handler must not start or stop the watchdog itself.
+     */
+    void startWatchdog(
+        std::chrono::milliseconds threshold, std::function<void(const WorkerState &)> handler = {})
+    {
+        static_assert(StatsPolicy::enabled, "the watchdog needs FullStats");
+        stopWatchdog();
+        watchdogStop = false;
+        watchdog_thread = ThreadOptions::createDefault([&] {
+            return std::make_unique<PcoThread>(
+                &BasicThreadPool::watchdog, this, threshold, std::move(handler));
+        });
+    }
+
+    /* Stops the watchdog, if any. */
+    void stopWatchdog()
+    {
+        if (!watchdog_thread) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(watchdogMutex);
+            watchdogStop = true;
+        }
+        watchdogCond.notify_all();
+        watchdog_thread->join();
+        watchdog_thread.reset();
+    }
+
+    /**
+     * The wall and CPU time accounting of the runnables by id, disabled until
+     * enable() is called on it.
+     */
+    TaskAccounting &accounting() { return taskAccounting; }
+
+#if PROFILE_MONITOR
+    /**
+     * Returns the acquire wait and hold time histograms of every monitor call
+     * site. Only available when built with PROFILE_MONITOR.
+     */
+    std::vector<MonitorSiteProfile> monitorProfile() const
+    {
+        std::vector<MonitorSiteProfile> result(nbMonitorSites);
+        for (size_t i = 0; i < nbMonitorSites; ++i) {
+            result[i].site = static_cast<MonitorSite>(i);
+            result[i].acquire = profile[i].acquire.snapshot();
+            result[i].hold = profile[i].hold.snapshot();
+        }
+        return result;
+    }
+#endif
+
+    /**
+     * Blocks until the queue is empty and no runnable is running anymore, or
+     * until the timeout expires. Returns whether the pool is done.
+     */
+    bool waitForDone(std::chrono::milliseconds timeout = std::chrono::milliseconds::max())
+    {
+        std::unique_lock<std::mutex> lock(idleMutex);
+        auto done = [this] { return inFlight == 0; };
+        // NOTE: wait_for() overflows with milliseconds::max()
+        if (timeout == std::chrono::milliseconds::max()) {
+            idleCond.wait(lock, done);
+            return true;
+        }
+        return idleCond.wait_for(lock, timeout, done);
+    }
+
+    /**
+     * Withdraws every queued runnable whose id() is the given one and calls
+     * cancelRun() on them. The runnables with that id currently running are
+     * flagged, see isCancelled(). Returns the number of withdrawn runnables.
+     */
+    size_t cancel(const std::string &id)
+    {
+        static_assert(QueuePolicy::indexed, "cancel() needs IndexedQueue");
+        return cancelMatching(byId, id, &worker_t::current_id);
+    }
+
+    /**
+     * Same as cancel() but for the runnables started with the given group.
+     */
+    size_t cancelGroup(const std::string &group)
+    {
+        static_assert(QueuePolicy::indexed, "cancelGroup() needs IndexedQueue");
+        if (group.empty()) {
+            return 0;
+        }
+        return cancelMatching(byGroup, group, &worker_t::current_group);
+    }
+
+    /**
+     * Whether the runnable executed by the calling thread has been cancelled,
+     * either through its token or through cancel()/cancelGroup(). Meant to be
+     * polled by long running tasks, always false outside of a worker.
+     */
+    static bool isCancelled()
+    {
+        const WorkerContext *wrkr = WorkerContext::current;
+        return wrkr
+               && (wrkr->cancelled.load(std::memory_order_relaxed)
+                   || wrkr->current_token.isCancelled());
+    }
+
+    /**
+     * Returns the scratch arena of the worker running the calling task, a
+     * monotonic bump allocator whose memory is all taken back at once when
+     * run() returns and the runnable is destroyed, nothing allocated from it
+     * may outlive that. Once the arena is full, the allocations go to the
+     * heap until the reset. Outside of a worker or without arenas, see
+     * setArenaSize(), this is the heap.
+     *
+     *     std::pmr::vector<float> samples(ThreadPool::currentArena());
+     */
+    static std::pmr::memory_resource *currentArena()
+    {
+        WorkerContext *wrkr = WorkerContext::current;
+        if (wrkr && wrkr->arena) {
+            return &*wrkr->arena;
+        }
+        return std::pmr::new_delete_resource();
+    }
 
 private:
     typedef typename std::chrono::steady_clock Clock;
     typedef typename std::chrono::time_point<Clock> TimePoint;
     typedef typename ::size_t Key;
+    typedef typename SyncPolicy::Condition Condition;
     typedef typename std::pair<PcoThread *, std::pair<TimePoint, Condition *>> TimeOutNode;
 
     // The maximum number of worker threads
     size_t maxThreadCount;
     // The max number of tasks that can be stored in the queue
     size_t maxNbWaiting;
+    // The number of tasks in the queue, tombstones excluded. Only modified
+    // within the monitor but, as the counters below, readable from anywhere.
+    std::atomic<size_t> nbQueued{0};
+    // The number of tasks being run
+    std::atomic<size_t> nbActive{0};
     // The number of threads that are waiting for a task
-    size_t nbAvailable;
+    std::atomic<size_t> nbAvailable;
+    // The number of tasks queued or being run, the worker bringing it down to
+    // 0 notifies idleCond
+    std::atomic<size_t> inFlight{0};
+    // The number of workers, threads.size() can't be read outside the monitor
+    std::atomic<size_t> nbThreads{0};
+    // The most tasks there ever was in the queue
+    size_t queueHighWater = 0;
+    // The number of tasks refused by start()
+    uint64_t nbRejected = 0;
+    // The number of workers spinning before they park, at most maxSpinners
+    size_t nbSpinning = 0;
+    size_t maxSpinners = std::thread::hardware_concurrency() / 2;
+    // The longest a worker spins before it parks
+    uint64_t maxSpinNs = 50000;
+    // The size of the scratch arena of each worker, 0 for none
+    std::atomic<size_t> arenaSize{0};
+    // The placement of the workers, and how many times it was set
+    Placement placement;
+    uint64_t placementVersion = 0;
+    // The times a worker failed to pin itself
+    std::atomic<size_t> nbPinFailures{0};
     // The next thread id to use in the map.
     // NOTE: looking back, a circular buffer should have worked
     size_t next_thread_id = 0;
     // The time before a waiting worker should be timed out
     std::chrono::milliseconds idleTimeout;
+    // Set once shutdown() has been called
+    bool stopped = false;
+
+    // Used by waitForDone() and shutdown() to wait for the tasks to be done or
+    // the queue to be drained with a timeout, which a Condition cannot do
+    std::mutex idleMutex;
+    std::condition_variable idleCond;
 
 #if LOG_IN_OUT
     // The number of times monitorIn was called
@@ -188,11 +802,147 @@ private:
     std::atomic<size_t> out{0};
 #endif
 
+#if PROFILE_MONITOR
+    struct site_profile_t
+    {
+        AtomicHistogram acquire;
+        AtomicHistogram hold;
+    };
+
+    std::array<site_profile_t, nbMonitorSites> profile;
+    // The site holding the monitor and since when, only accessed by the holder
+    MonitorSite holder = MonitorSite::Start;
+    uint64_t holdSince = 0;
+#endif
+
+    /**
+     * The counters of a worker, only written by the worker itself and summed
+     * up by stats(). Aligned so that two workers never share a cache line.
+     */
+    struct alignas(64) worker_stats_t
+    {
+        std::atomic<uint64_t> tasks{0};
+        std::atomic<uint64_t> busyNs{0};
+        std::atomic<uint64_t> idleNs{0};
+        AtomicHistogram queueWait;
+        AtomicHistogram runTime;
+    };
+
+    // The counters of a worker without stats, which keep nothing
+    struct no_stats_t
+    {};
+
+    static constexpr size_t maxStateIdLength = 63;
+    // The gap of a worker that never waited yet
+    static constexpr uint64_t noGap = std::numeric_limits<uint64_t>::max();
+
+    /**
+     * What a worker is doing, readable without the monitor. The running task
+     * is published under a seqlock: the worker makes seq odd while writing and
+     * the readers retry when they saw it odd or changing. Every field is a
+     * relaxed atomic so that the concurrent reads aren't data races.
+     */
+    struct alignas(64) worker_slot_t
+    {
+        // Whether the slot belongs to a worker, only changed within the monitor
+        std::atomic<bool> used{false};
+        std::atomic<size_t> worker{0};
+        std::atomic<uint64_t> seq{0};
+        // When the running task started, 0 when none is
+        std::atomic<uint64_t> since{0};
+        std::atomic<uint64_t> started{0};
+        // The id of the running task, NUL terminated
+        std::array<std::atomic<char>, maxStateIdLength + 1> id{};
+
+        /* Publishes the task being started. Only called by the worker. */
+        void begin(const std::string &taskId, uint64_t now)
+        {
+            uint64_t s = seq.load(std::memory_order_relaxed);
+            seq.store(s + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            size_t length = std::min(taskId.size(), maxStateIdLength);
+            for (size_t i = 0; i < length; ++i) {
+                id[i].store(taskId[i], std::memory_order_relaxed);
+            }
+            id[length].store('\0', std::memory_order_relaxed);
+            since.store(now, std::memory_order_relaxed);
+            started.store(started.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            seq.store(s + 2, std::memory_order_release);
+        }
+
+        /* Publishes that the task is done. Only called by the worker. */
+        void end()
+        {
+            uint64_t s = seq.load(std::memory_order_relaxed);
+            seq.store(s + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            since.store(0, std::memory_order_relaxed);
+            seq.store(s + 2, std::memory_order_release);
+        }
+
+        WorkerState read(uint64_t now) const
+        {
+            WorkerState state;
+            state.id = worker.load(std::memory_order_relaxed);
+            while (true) {
+                uint64_t s = seq.load(std::memory_order_acquire);
+                if (s % 2) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                uint64_t begun = since.load(std::memory_order_relaxed);
+                state.started = started.load(std::memory_order_relaxed);
+                state.task.clear();
+                for (size_t i = 0; begun && i <= maxStateIdLength; ++i) {
+                    char c = id[i].load(std::memory_order_relaxed);
+                    if (c == '\0') {
+                        break;
+                    }
+                    state.task.push_back(c);
+                }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (seq.load(std::memory_order_relaxed) != s) {
+                    continue;
+                }
+                state.running = begun != 0;
+                state.elapsed = std::chrono::nanoseconds(begun && now > begun ? now - begun : 0);
+                return state;
+            }
+        }
+    };
+
+    /**
+     * The tickets of the queued tasks by id or by group, oldest first. Each
+     * task keeps the position of its tickets so that dequeuing it only costs
+     * a lookup of its key, whatever the number of tasks sharing it.
+     */
+    typedef std::unordered_map<std::string, std::list<size_t>> Index;
+
+    /**
+     * A task waiting in the queue. Cancelling a queued task leaves a tombstone
+     * (a task without runnable) behind that is dropped once it reaches the
+     * front of the queue, so that the tickets of the other tasks stay valid.
+     */
+    struct task_t
+    {
+        std::unique_ptr<Runnable> runnable;
+        std::string id;
+        std::string group;
+        // Where the ticket of the task is in byId and byGroup, if indexed
+        std::list<size_t>::iterator inId{};
+        std::list<size_t>::iterator inGroup{};
+        CancellationToken token;
+        // The NUMA node whose queue the task goes to
+        size_t node = 0;
+        // When the task was queued, see nowNs()
+        uint64_t enqueued = 0;
+    };
+
     /**
      * Contains everything that's necessary to know the status of a worker and
      * interact with it
      */
-    struct worker_t
+    struct worker_t : WorkerContext
     {
         // A pointer to the thread
         std::shared_ptr<PcoThread> thread;
@@ -202,12 +952,43 @@ private:
         // technically the Condition knows if a thread is waiting but it's
         // private and we can't modify the class so we need to manage this info
         // here
-        bool waiting;
+        bool waiting = false;
+        // The node of the worker in idleWorkers, kept in idleNode while the
+        // worker isn't parked. Moved between the two by splicing, which
+        // neither allocates nor invalidates idlePos.
+        std::list<Key> idleNode;
+        std::list<Key>::iterator idlePos;
         // The time at which point it should be considered as timed out if still
         // waiting
         TimePoint timeout;
         // used to distinguish between timeout and stop request
-        bool timed_out;
+        bool timed_out = false;
+        // The id and group of the task being run, only accessed within the
+        // monitor
+        std::string current_id;
+        std::string current_group;
+        // Opened by the worker itself the first time the accounting asks for
+        // the perf counters
+        std::unique_ptr<PerfCounters> perf;
+        // Where the worker publishes what it is doing
+        worker_slot_t *slot = nullptr;
+        // The task given by start() while the worker was parked, if any
+        task_t handoff;
+        // The moving average of the time the worker waited for a task, only
+        // accessed by the worker
+        uint64_t gapNs = noGap;
+        // The buffer of the arena, of arenaSize bytes, only accessed by the
+        // worker
+        std::unique_ptr<std::byte[]> arenaBuffer;
+        size_t arenaSize = 0;
+        // The NUMA node of the worker and the CPUs it is pinned to, along
+        // with the placementVersion they follow. Only written by the worker,
+        // within the monitor but for pinned, which only the worker reads.
+        size_t node = 0;
+        bool pinned = false;
+        std::vector<int> cpus;
+        uint64_t placement = 0;
+        std::conditional_t<StatsPolicy::enabled, worker_stats_t, no_stats_t> stats;
     };
 
     /**
@@ -217,140 +998,820 @@ private:
     */
     std::map<Key, worker_t> threads;
 
-    // The queue of tasks that cannot be executed straight away
-    std::queue<std::unique_ptr<Runnable>> queue;
+    // The parked workers, the one parked last at the back
+    std::list<Key> idleWorkers;
+
+    /**
+     * The tasks that cannot be executed straight away, queued for a NUMA node.
+     * The task at index i has the ticket front_ticket + i and is indexed under
+     * the key ticket * queues.size() + its node.
+     */
+    struct node_queue_t
+    {
+        std::deque<task_t> tasks;
+        size_t front_ticket = 0;
+    };
+
+    // One queue per NUMA node
+    std::vector<node_queue_t> queues;
+
+    const NumaTopology &topology = NumaTopology::system();
+
+    // The tickets of the queued tasks by id and by group, used to cancel them
+    // without going through the whole queue
+    Index byId;
+    Index byGroup;
+
+    // The counters of the workers that are gone
+    ThreadPoolStats retired;
+
+    TaskAccounting taskAccounting;
+
+    // The monitor guarding the pool
+    SyncPolicy sync;
+
+    // Called by every worker when it starts and stops
+    const ThreadOptions options;
+    // The settings of the options that couldn't be applied to a worker
+    std::atomic<size_t> nbOptionFailures{0};
+    WorkerHooks hooks;
+
+    // The clock of the idle timeouts
+    std::shared_ptr<PoolClock> clock;
+    // Set to interrupt the sleep of the timer when it has to stop
+    std::atomic<bool> timerWake{false};
+
+    // One per possible worker, see workerStates()
+    std::unique_ptr<worker_slot_t[]> slots;
 
     std::unique_ptr<PcoThread> timer_thread;
 
+    std::unique_ptr<PcoThread> watchdog_thread;
+    std::mutex watchdogMutex;
+    std::condition_variable watchdogCond;
+    bool watchdogStop = false;
+
 #if LOG_TASKS
     std::size_t accepted = 0;
     std::size_t refused = 0;
     std::size_t executed = 0;
 #endif
 
-#if LOG_IN_OUT
-    void monitorIn()
+    void monitorIn(MonitorSite site)
     {
-        PcoHoareMonitor::monitorIn();
+#if PROFILE_MONITOR
+        uint64_t before = nowNs();
+#endif
+        sync.lock();
+#if LOG_IN_OUT
         ++in;
+#endif
+#if PROFILE_MONITOR
+        holdSince = nowNs();
+        holder = site;
+        profile[static_cast<size_t>(site)].acquire.record(holdSince - before);
+#else
+        (void) site;
+#endif
     }
 
     void monitorOut()
     {
+#if LOG_IN_OUT
         ++out;
-        PcoHoareMonitor::monitorOut();
+#endif
+#if PROFILE_MONITOR
+        releaseProfiled();
+#endif
+        sync.unlock();
+    }
+
+    // NOTE: the monitor changes hands within wait(), and within signal() with
+    // Hoare semantics, without going through monitorIn()/monitorOut(), the hold
+    // time is split accordingly. There is no acquire wait to record: Hoare
+    // monitors hand it over directly and the Mesa ones take it back within
+    // wait(), which counts as parked.
+    void wait(Condition &cond)
+    {
+#if PROFILE_MONITOR
+        releaseProfiled();
+#endif
+        sync.wait(cond);
+#if PROFILE_MONITOR
+        holdSince = nowNs();
+        holder = MonitorSite::WorkerPark;
+#endif
+    }
+
+    void signal(Condition &cond)
+    {
+#if PROFILE_MONITOR
+        if constexpr (SyncPolicy::handsOver) {
+            MonitorSite site = holder;
+            releaseProfiled();
+            sync.signal(cond);
+            holdSince = nowNs();
+            holder = site;
+            return;
+        }
+#endif
+        sync.signal(cond);
+    }
+
+#if PROFILE_MONITOR
+    void releaseProfiled()
+    {
+        profile[static_cast<size_t>(holder)].hold.record(nowNs() - holdSince);
+    }
+#endif
+
+    /**
+     * Whether anything reads the id() of the tasks: the index, the slots or
+     * the accounting. id() builds a string, the other pools skip it.
+     */
+    bool readsIds() const
+    {
+        return QueuePolicy::indexed || StatsPolicy::enabled || taskAccounting.isEnabled();
+    }
+
+    /**
+     * Queues a task and indexes it. Must be called within the monitor.
+     */
+    void push(task_t task)
+    {
+        node_queue_t &queue = queues[task.node];
+        size_t ticket = (queue.front_ticket + queue.tasks.size()) * queues.size() + task.node;
+        if (readsIds()) {
+            task.id = task.runnable->id();
+        }
+        if constexpr (QueuePolicy::indexed) {
+            std::list<size_t> &ids = byId[task.id];
+            task.inId = ids.insert(ids.end(), ticket);
+            if (!task.group.empty()) {
+                std::list<size_t> &groups = byGroup[task.group];
+                task.inGroup = groups.insert(groups.end(), ticket);
+            }
+        }
+        if constexpr (StatsPolicy::enabled) {
+            task.enqueued = nowNs();
+        }
+        queue.tasks.push_back(std::move(task));
+        Tracer::record(TraceEvent::Enqueue, ticket);
+        ++nbQueued;
+        ++inFlight;
+        if constexpr (StatsPolicy::enabled) {
+            if (nbQueued > queueHighWater) {
+                queueHighWater = nbQueued;
+            }
+        }
+    }
+
+    /**
+     * Starts a new worker. Must be called within the monitor with less than
+     * maxThreadCount workers, returns its id.
+     */
+    Key spawn()
+    {
+        // NOTE: the worker only looks itself up once we leave the monitor
+        size_t id = next_thread_id++;
+        worker_t &wrkr = threads.try_emplace(id).first->second;
+        wrkr.idlePos = wrkr.idleNode.insert(wrkr.idleNode.end(), id);
+        ++nbThreads;
+        // NOTE: there are as many slots as threads can be, one is free
+        wrkr.slot = &slots[0];
+        while (wrkr.slot->used.load(std::memory_order_relaxed)) {
+            ++wrkr.slot;
+        }
+        wrkr.slot->worker.store(id, std::memory_order_relaxed);
+        wrkr.slot->started.store(0, std::memory_order_relaxed);
+        wrkr.slot->used.store(true, std::memory_order_relaxed);
+        wrkr.cond = std::make_shared<Condition>();
+        wrkr.thread = options.createThread(
+            [this, id] { return std::make_shared<PcoThread>(&BasicThreadPool::worker, this, id); },
+            nbOptionFailures);
+        Tracer::record(TraceEvent::Spawn, id);
+        return id;
+    }
+
+    /**
+     * Takes a parked worker out of the idle ones and wakes it up. The worker
+     * only leaves wait() once waiting is cleared, which keeps it parked on
+     * the spurious wake ups of the Mesa backends. Must be called within the
+     * monitor.
+     */
+    void wake(Key id)
+    {
+        worker_t &wrkr = threads.at(id);
+        wrkr.idleNode.splice(wrkr.idleNode.end(), idleWorkers, wrkr.idlePos);
+        wrkr.waiting = false;
+        --nbAvailable;
+        signal(*wrkr.cond);
+    }
+
+    /**
+     * Returns the worker parked last on the given node, or the one parked
+     * last if none is. Must be called within the monitor with nbAvailable > 0.
+     */
+    Key idleWorker(size_t node)
+    {
+        if (queues.size() > 1) {
+            for (auto it = idleWorkers.rbegin(); it != idleWorkers.rend(); ++it) {
+                if (threads.at(*it).node == node) {
+                    return *it;
+                }
+            }
+        }
+        return idleWorkers.back();
+    }
+
+    /**
+     * Gives a task to the worker parked last on its node, or to another one
+     * rather than waiting, and wakes it up. Must be called within the monitor
+     * with nbAvailable > 0.
+     */
+    void handOff(task_t task)
+    {
+        Key id = idleWorker(task.node);
+        if (readsIds()) {
+            task.id = task.runnable->id();
+        }
+        if constexpr (StatsPolicy::enabled) {
+            task.enqueued = nowNs();
+        }
+        threads.at(id).handoff = std::move(task);
+        Tracer::record(TraceEvent::Handoff, id);
+        ++inFlight;
+        ++nbActive;
+        wake(id);
+    }
+
+    /**
+     * Dequeues the first task that hasn't been cancelled from the queue of the
+     * given node, or else of the nearest node having one. Must be called
+     * within the monitor with nbQueued > 0.
+     */
+    task_t pop(size_t node)
+    {
+        for (size_t from : topology.nearest(node)) {
+            node_queue_t &queue = queues[from];
+            while (!queue.tasks.empty()) {
+                task_t task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+                size_t ticket = queue.front_ticket++ * queues.size() + from;
+                if (!task.runnable) {
+                    continue;
+                }
+
+                Tracer::record(TraceEvent::Dequeue, ticket);
+                if constexpr (QueuePolicy::indexed) {
+                    unindex(byId, task.id, task.inId);
+                    if (!task.group.empty()) {
+                        unindex(byGroup, task.group, task.inGroup);
+                    }
+                }
+                --nbQueued;
+                ++nbActive;
+                checkDrained();
+                return task;
+            }
+        }
+        assert(false && "pop() called on empty queues");
+        return {};
+    }
+
+    /**
+     * Wakes up shutdown() if it waits for the queue to get empty. Must be called
+     * within the monitor.
+     */
+    void checkDrained()
+    {
+        if (stopped && nbQueued == 0) {
+            notifyIdle();
+        }
+    }
+
+    /**
+     * Accounts for tasks that are done, either run or cancelled, and wakes up
+     * waitForDone() when they were the last ones.
+     */
+    void tasksDone(size_t nb)
+    {
+        if (nb && inFlight.fetch_sub(nb) == nb) {
+            notifyIdle();
+        }
+    }
+
+    void notifyIdle()
+    {
+        // NOTE: the mutex makes sure that a waiter is either waiting or
+        // hasn't checked its predicate yet
+        { std::lock_guard<std::mutex> lock(idleMutex); }
+        idleCond.notify_all();
+    }
+
+    /**
+     * Withdraws every queued task and calls cancelRun() on them. Returns the
+     * number of cancelled tasks.
+     */
+    size_t cancelPending()
+    {
+        std::vector<std::unique_ptr<Runnable>> cancelled;
+
+        monitorIn(MonitorSite::Shutdown);
+        for (node_queue_t &queue : queues) {
+            for (auto &task : queue.tasks) {
+                if (task.runnable) {
+                    cancelled.push_back(std::move(task.runnable));
+                }
+            }
+            queue.front_ticket += queue.tasks.size();
+            queue.tasks.clear();
+        }
+        byId.clear();
+        byGroup.clear();
+        nbQueued = 0;
+        checkDrained();
+        monitorOut();
+
+        for (auto &runnable : cancelled) {
+            runnable->cancelRun();
+        }
+        tasksDone(cancelled.size());
+
+        return cancelled.size();
+    }
+
+    /* Returns the time used by the stats, real time whatever the pool uses. */
+    static uint64_t nowNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    /* Adds to a counter that only the calling thread writes, without a locked
+     * instruction. */
+    static void add(std::atomic<uint64_t> &counter, uint64_t value)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    /**
+     * Keeps the counters of a worker that is about to be erased. Must be called
+     * within the monitor or once the workers are all joined.
+     */
+    void retire(const worker_t &wrkr)
+    {
+        if constexpr (StatsPolicy::enabled) {
+            retired.tasks += wrkr.stats.tasks.load(std::memory_order_relaxed);
+            retired.busyNs += wrkr.stats.busyNs.load(std::memory_order_relaxed);
+            retired.idleNs += wrkr.stats.idleNs.load(std::memory_order_relaxed);
+            wrkr.stats.queueWait.mergeInto(retired.queueWait);
+            wrkr.stats.runTime.mergeInto(retired.runTime);
+        }
+    }
+
+    /* Removes a ticket from an index, dropping its key with its last ticket. */
+    static void unindex(Index &index, const std::string &key, std::list<size_t>::iterator ticket)
+    {
+        auto found = index.find(key);
+        found->second.erase(ticket);
+        if (found->second.empty()) {
+            index.erase(found);
+        }
+    }
+
+    /**
+     * Tombstones the queued tasks found under the key of the given index and
+     * flags the running ones whose field matches the key.
+     */
+    size_t cancelMatching(Index &index, const std::string &key, std::string worker_t::*field)
+    {
+        std::vector<std::unique_ptr<Runnable>> cancelled;
+
+        monitorIn(MonitorSite::Cancel);
+        auto found = index.find(key);
+        if (found != index.end()) {
+            for (size_t ticket : found->second) {
+                node_queue_t &queue = queues[ticket % queues.size()];
+                task_t &task = queue.tasks[ticket / queues.size() - queue.front_ticket];
+                // NOTE: the task is still indexed under the other index
+                if (&index == &byId) {
+                    if (!task.group.empty()) {
+                        unindex(byGroup, task.group, task.inGroup);
+                    }
+                } else {
+                    unindex(byId, task.id, task.inId);
+                }
+                cancelled.push_back(std::move(task.runnable));
+                --nbQueued;
+            }
+            index.erase(found);
+        }
+
+        for (node_queue_t &queue : queues) {
+            while (!queue.tasks.empty() && !queue.tasks.front().runnable) {
+                queue.tasks.pop_front();
+                ++queue.front_ticket;
+            }
+        }
+        checkDrained();
+
+        for (auto it = threads.begin(); it != threads.end(); ++it) {
+            if (!it->second.waiting && it->second.*field == key) {
+                it->second.cancelled.store(true, std::memory_order_relaxed);
+            }
+        }
+        monitorOut();
+
+        // NOTE: the callbacks are user code, they are better off outside of
+        // the monitor
+        for (auto &runnable : cancelled) {
+            runnable->cancelRun();
+        }
+        tasksDone(cancelled.size());
+
+        return cancelled.size();
+    }
+
+    /**
+     * Returns how long the worker should spin before parking, 0 if it
+     * shouldn't. Must be called within the monitor.
+     */
+    uint64_t spinBudget(const worker_t &wrkr) const
+    {
+        // NOTE: the first wait has no history yet, it gets the full budget
+        if (wrkr.gapNs == noGap) {
+            return maxSpinNs;
+        }
+        return wrkr.gapNs > maxSpinNs ? 0 : std::min(2 * wrkr.gapNs, maxSpinNs);
+    }
+
+    /**
+     * Waits, outside of the monitor, until a task is queued, a stop is
+     * requested or the given time is reached. Spins with pause instructions
+     * for the first half and yields the core for the second one.
+     */
+    void spin(uint64_t until)
+    {
+        uint64_t yieldFrom = nowNs() / 2 + until / 2;
+        while (nbQueued.load(std::memory_order_relaxed) == 0
+               && !PcoThread::thisThread()->stopRequested()) {
+            uint64_t now = nowNs();
+            if (now >= until) {
+                return;
+            }
+            if (now < yieldFrom) {
+                for (int i = 0; i < 64; ++i) {
+                    cpuRelax();
+                }
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    /**
+     * Follows setPlacement(), returns whether the worker has to pin itself to
+     * its new CPUs. Only called by the worker itself, within the monitor.
+     */
+    bool place(worker_t &wrkr)
+    {
+        if (wrkr.placement == placementVersion) {
+            return false;
+        }
+        wrkr.placement = placementVersion;
+        size_t index = wrkr.slot - &slots[0];
+        std::vector<int> cpus;
+        for (int cpu : topology.allCpus()) {
+            if (placement.cpus.empty()
+                || std::find(placement.cpus.begin(), placement.cpus.end(), cpu)
+                       != placement.cpus.end()) {
+                cpus.push_back(cpu);
+            }
+        }
+        // NOTE: none of the given CPUs is allowed, better run anywhere
+        if (cpus.empty()) {
+            cpus = topology.allCpus();
+        }
+        wrkr.pinned = placement.pinning != Pinning::None;
+        switch (placement.pinning) {
+        case Pinning::None:
+            // NOTE: unpins a worker that was pinned before
+            wrkr.cpus = std::move(cpus);
+            break;
+        case Pinning::Core:
+            wrkr.cpus = {cpus[index % cpus.size()]};
+            wrkr.node = topology.nodeOf(wrkr.cpus.front());
+            break;
+        case Pinning::Node: {
+            std::vector<size_t> nodes;
+            for (int cpu : cpus) {
+                if (std::find(nodes.begin(), nodes.end(), topology.nodeOf(cpu)) == nodes.end()) {
+                    nodes.push_back(topology.nodeOf(cpu));
+                }
+            }
+            wrkr.node = nodes[index % nodes.size()];
+            wrkr.cpus.clear();
+            std::copy_if(cpus.begin(), cpus.end(), std::back_inserter(wrkr.cpus), [&](int cpu) {
+                return topology.nodeOf(cpu) == wrkr.node;
+            });
+            break;
+        }
+        }
+        return true;
+    }
+
+    /**
+     * Pins the calling worker to its CPUs, leaving it unpinned if that fails.
+     * Only called by the worker itself, outside of the monitor.
+     */
+    void pin(worker_t &wrkr)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : wrkr.cpus) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE) {
+                CPU_SET(cpu, &set);
+            }
+        }
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            // NOTE: the worker follows the node it runs on from then on
+            wrkr.pinned = false;
+            ++nbPinFailures;
+        }
+    }
+
+    /* Follows setArenaSize(), only called by the worker itself. */
+    void resizeArena(worker_t &wrkr)
+    {
+        size_t size = arenaSize.load(std::memory_order_relaxed);
+        if (size == wrkr.arenaSize) {
+            return;
+        }
+        wrkr.arena.reset();
+        wrkr.arenaBuffer.reset(size ? new std::byte[size] : nullptr);
+        wrkr.arenaSize = size;
+        if (size) {
+            wrkr.arena.emplace(wrkr.arenaBuffer.get(), size, std::pmr::new_delete_resource());
+        }
     }
+
+    static void cpuRelax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
 #endif
+    }
 
     void worker(size_t id)
     {
-        monitorIn();
+        monitorIn(MonitorSite::WorkerDequeue);
         worker_t &wrkr = threads.at(id);
+        bool repin = place(wrkr);
         monitorOut();
+        if (repin) {
+            pin(wrkr);
+        }
+        WorkerContext::current = &wrkr;
+        options.apply(id, nbOptionFailures);
+        if (Tracer::isEnabled()) {
+            Tracer::nameThread("worker " + std::to_string(id));
+        }
+        if (hooks.onStart) {
+            hooks.onStart(id);
+        }
 
         while (true) {
-            monitorIn();
+            monitorIn(MonitorSite::WorkerDequeue);
 
 #if LOG_WORK > 2
-            PcoLogger() << "[worker" << id << "]" << "in" << std::endl;
+            AsyncLog() << "[worker" << id << "]" << "in" << std::endl;
 #endif
 
 #if LOG_WORK
             if (PcoThread::thisThread()->stopRequested()) {
-                PcoLogger() << "[worker" << id << "]" << "stop requested before" << std::endl;
+                AsyncLog() << "[worker" << id << "]" << "stop requested before" << std::endl;
             }
 #endif
 
-            if (queue.empty() && !wrkr.timed_out && !PcoThread::thisThread()->stopRequested()) {
-                wrkr.timeout = Clock::now() + idleTimeout;
-                wrkr.waiting = true;
-                ++nbAvailable;
-                wait(*wrkr.cond);
-                --nbAvailable;
-                wrkr.waiting = false;
+            if (nbQueued == 0 && !wrkr.timed_out && !PcoThread::thisThread()->stopRequested()) {
+                uint64_t idleSince = nowNs();
+                uint64_t budget = spinBudget(wrkr);
+                if (budget && nbSpinning < maxSpinners) {
+                    ++nbSpinning;
+                    monitorOut();
+                    spin(idleSince + budget);
+                    monitorIn(MonitorSite::WorkerDequeue);
+                    --nbSpinning;
+                }
+
+                if (nbQueued == 0 && !PcoThread::thisThread()->stopRequested()) {
+                    if constexpr (!GrowthPolicy::fixed) {
+                        wrkr.timeout = clock->now() + idleTimeout;
+                    }
+                    wrkr.waiting = true;
+                    ++nbAvailable;
+                    idleWorkers.splice(idleWorkers.end(), wrkr.idleNode, wrkr.idlePos);
+                    Tracer::record(TraceEvent::Park, id);
+                    // NOTE: whoever wakes the worker up clears waiting, see
+                    // wake()
+                    while (wrkr.waiting) {
+                        wait(*wrkr.cond);
+                    }
+                    Tracer::record(TraceEvent::Unpark, id);
+                }
+
+                uint64_t idle = nowNs() - idleSince;
+                if constexpr (StatsPolicy::enabled) {
+                    add(wrkr.stats.idleNs, idle);
+                }
+                // NOTE: only the gaps that ended with a task tell something
+                // about the arrivals
+                if (nbQueued > 0 || wrkr.handoff.runnable) {
+                    wrkr.gapNs = wrkr.gapNs == noGap ? idle : wrkr.gapNs - wrkr.gapNs / 8 + idle / 8;
+                }
 
 #if LOG_WORK
                 if (PcoThread::thisThread()->stopRequested()) {
-                    PcoLogger() << "[worker" << id << "]" << "stop in before" << std::endl;
+                    AsyncLog() << "[worker" << id << "]" << "stop in before" << std::endl;
                 }
 
                 if (wrkr.timed_out) {
-                    PcoLogger() << "[worker" << id << "]" << "timed out" << std::endl;
+                    AsyncLog() << "[worker" << id << "]" << "timed out" << std::endl;
                 }
 #endif
             }
 
-            // NOTE: we still check if the queue is empty since we probably
-            // shouldn't leave jobs that we promised to treat
-            if ((PcoThread::thisThread()->stopRequested() && queue.empty()) || wrkr.timed_out) {
-                break;
+            bool repin = place(wrkr);
+            if (!wrkr.pinned) {
+                wrkr.node = topology.currentNode();
             }
 
-            std::unique_ptr<Runnable> runnable = std::move(queue.front());
-            queue.pop();
+            task_t task;
+            if (wrkr.handoff.runnable) {
+                task = std::move(wrkr.handoff);
+            } else {
+                // NOTE: we still check if the queue is empty since we probably
+                // shouldn't leave jobs that we promised to treat
+                if ((PcoThread::thisThread()->stopRequested() && nbQueued == 0)
+                    || wrkr.timed_out) {
+                    break;
+                }
+                task = pop(wrkr.node);
+            }
+            wrkr.current_id = std::move(task.id);
+            wrkr.current_group = std::move(task.group);
+            wrkr.current_token = std::move(task.token);
+            wrkr.cancelled.store(false, std::memory_order_relaxed);
+            bool accounted = taskAccounting.isEnabled();
+            if constexpr (!QueuePolicy::indexed && !StatsPolicy::enabled) {
+                // NOTE: the accounting may have been enabled since the task
+                // was queued without its id
+                if (accounted && wrkr.current_id.empty()) {
+                    wrkr.current_id = task.runnable->id();
+                }
+            }
 
 #if LOG_WORK > 2
-            PcoLogger() << "[worker" << id << "]" << "out" << std::endl;
+            AsyncLog() << "[worker" << id << "]" << "out" << std::endl;
 #endif
             monitorOut();
+            if (repin) {
+                pin(wrkr);
+            }
 
-            runnable->run();
+            uint64_t cpuBegin = accounted ? TaskAccounting::threadCpuNs() : 0;
+            bool counted = accounted && taskAccounting.hasPerfCounters();
+            if (counted && !wrkr.perf) {
+                wrkr.perf = std::make_unique<PerfCounters>();
+            }
+            PerfSample perfBegin = counted ? wrkr.perf->read() : PerfSample{};
+            resizeArena(wrkr);
+            uint64_t begin = StatsPolicy::enabled || accounted ? nowNs() : 0;
+            if constexpr (StatsPolicy::enabled) {
+                wrkr.slot->begin(wrkr.current_id, begin);
+                wrkr.stats.queueWait.record(begin - task.enqueued);
+            }
+            Tracer::record(TraceEvent::RunStart, id);
+            if (wrkr.current_token.isCancelled()) {
+                task.runnable->cancelRun();
+            } else {
+                task.runnable->run();
+            }
+            Tracer::record(TraceEvent::RunEnd, id);
+            uint64_t end = StatsPolicy::enabled || accounted ? nowNs() : 0;
+            if constexpr (StatsPolicy::enabled) {
+                wrkr.slot->end();
+                wrkr.stats.runTime.record(end - begin);
+                add(wrkr.stats.busyNs, end - begin);
+                add(wrkr.stats.tasks, 1);
+            }
+            if (accounted) {
+                // NOTE: current_id is only written by this worker
+                taskAccounting.record(
+                    wrkr.current_id,
+                    end - begin,
+                    TaskAccounting::threadCpuNs() - cpuBegin,
+                    counted ? wrkr.perf->read() - perfBegin : PerfSample{});
+            }
+            // NOTE: destroyed before waitForDone() can return
+            task.runnable.reset();
+            if (wrkr.arena) {
+                // NOTE: only frees something when the arena overflowed
+                wrkr.arena->release();
+            }
+            --nbActive;
+            tasksDone(1);
 #if LOG_TASKS
             ++executed;
 #endif
         }
 
         monitorOut();
+        if (hooks.onStop) {
+            hooks.onStop(id);
+        }
     }
 
     void timer()
     {
         while (true) {
-            monitorIn();
+            monitorIn(MonitorSite::Timer);
 
 #if LOG_TIMER > 2
-            PcoLogger() << "[timer]" << "in" << std::endl;
+            AsyncLog() << "[timer]" << "in" << std::endl;
 #endif
             if (PcoThread::thisThread()->stopRequested()) {
 #if LOG_TIMER
-                PcoLogger() << "[timer]" << "break" << std::endl;
+                AsyncLog() << "[timer]" << "break" << std::endl;
 #endif
                 break;
             }
 
-            std::queue<size_t> deleted{};
+            std::vector<std::pair<Key, std::shared_ptr<PcoThread>>> deleted;
 
 #if LOG_TIMER > 1
-            PcoLogger() << "[timer]" << "iterating" << std::endl;
+            AsyncLog() << "[timer]" << "iterating" << std::endl;
 #endif
+            TimePoint now = clock->now();
             for (auto it = threads.begin(); it != threads.end(); ++it) {
-                if (it->second.waiting && it->second.timeout < Clock::now()) {
-                    deleted.push(it->first);
+                // NOTE: a timeout equal to now is reached, or a virtual clock
+                // stopped right on it would never get there
+                if (it->second.waiting && it->second.timeout <= now) {
+                    deleted.emplace_back(it->first, it->second.thread);
                     it->second.timed_out = true;
+                    Tracer::record(TraceEvent::Timeout, it->first);
 
 #if LOG_TIMER
-                    PcoLogger() << "[timer]" << "<signal" << std::endl;
+                    AsyncLog() << "[timer]" << "<signal" << std::endl;
 #endif
-                    signal(*it->second.cond);
+                    wake(it->first);
 #if LOG_TIMER
-                    PcoLogger() << "[timer]" << "signal>" << std::endl;
+                    AsyncLog() << "[timer]" << "signal>" << std::endl;
 #endif
                 }
             }
 
 #if LOG_TIMER > 1
-            PcoLogger() << "[timer]" << "releasing" << std::endl;
+            AsyncLog() << "[timer]" << "releasing" << std::endl;
 #endif
-            while (!deleted.empty()) {
-                auto it = threads.find(deleted.front());
-                // TODO: Check if there is issues with the  code below
-                it->second.thread->join();
-                deleted.pop();
-                threads.erase(it);
+            if (!deleted.empty()) {
+                // NOTE: the workers need the monitor to leave, they are joined
+                // outside of it. Nobody else erases them meanwhile: shutdown()
+                // only does once the timer is joined.
+                monitorOut();
+                for (auto &[key, thread] : deleted) {
+                    thread->join();
+                }
+                monitorIn(MonitorSite::Timer);
+                for (auto &[key, thread] : deleted) {
+                    auto it = threads.find(key);
+                    retire(it->second);
+                    it->second.slot->used.store(false, std::memory_order_relaxed);
+                    threads.erase(it);
+                    --nbThreads;
+                }
+
+                // NOTE: start() still counted the workers being joined and may
+                // have queued tasks for them instead of spawning, which they
+                // left behind
+                for (size_t needed = nbQueued;
+                     needed > 0 && nbAvailable == 0 && threads.size() < maxThreadCount;
+                     --needed) {
+                    Key id = spawn();
+                    // NOTE: shutdown() may have requested the others to stop
+                    // meanwhile, this one still drains the queue before
+                    if (stopped) {
+                        threads.at(id).thread->requestStop();
+                    }
+                }
             }
 
             // NOTE: finding the next timing to wakeup
-            TimePoint until = Clock::now() + idleTimeout;
+            TimePoint until = clock->now() + idleTimeout;
             for (auto it = threads.begin(); it != threads.end(); ++it) {
                 if (!it->second.waiting || it->second.timed_out) {
                     continue;
@@ -362,15 +1823,60 @@ private:
             }
 
 #if LOG_TIMER > 2
-            PcoLogger() << "[timer]" << "out" << std::endl;
+            AsyncLog() << "[timer]" << "out" << std::endl;
 #endif
             monitorOut();
 
-            std::this_thread::sleep_until(until);
+            clock->sleepUntil(until, timerWake);
         }
 
         monitorOut();
     }
+
+    void watchdog(std::chrono::milliseconds threshold, std::function<void(const WorkerState &)> handler)
+    {
+        uint64_t thresholdNs = std::chrono::duration_cast<std::chrono::nanoseconds>(threshold).count();
+        // NOTE: checking 4 times per threshold reports a stall at most a
+        // quarter of the threshold late
+        auto period = std::max(threshold / 4, std::chrono::milliseconds{1});
+        // The worker and started count of the last task reported per slot, so
+        // that a stalled task is only reported once
+        std::vector<std::pair<size_t, uint64_t>> reported(maxThreadCount);
+
+        std::unique_lock<std::mutex> lock(watchdogMutex);
+        while (!watchdogCond.wait_for(lock, period, [this] { return watchdogStop; })) {
+            // NOTE: the mutex only guards watchdogStop, the scan runs without it
+            lock.unlock();
+            uint64_t now = nowNs();
+            for (size_t i = 0; i < maxThreadCount; ++i) {
+                if (!slots[i].used.load(std::memory_order_relaxed)) {
+                    continue;
+                }
+                WorkerState state = slots[i].read(now);
+                std::pair<size_t, uint64_t> task{state.id, state.started};
+                if (!state.running || task == reported[i]
+                    || static_cast<uint64_t>(state.elapsed.count()) < thresholdNs) {
+                    continue;
+                }
+                reported[i] = task;
+                if (handler) {
+                    handler(state);
+                } else {
+                    AsyncLog() << "[watchdog] worker " << state.id << " stalled on " << state.task
+                                << " for "
+                                << std::chrono::duration_cast<std::chrono::milliseconds>(state.elapsed)
+                                       .count()
+                                << " ms" << std::endl;
+                }
+            }
+            lock.lock();
+        }
+    }
 };
 
+using ThreadPool = BasicThreadPool<>;
+
+// A pool of workers living as long as it, without stats nor cancel()
+using FixedThreadPool = BasicThreadPool<PlainQueue, HoareSync, FixedGrowth, NoStats>;
+
 #endif // THREADPOOL_H
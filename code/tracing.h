@@ -0,0 +1,286 @@
+#ifndef TRACING_H
+#define TRACING_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+ * The scheduler events recorded by the Tracer.
+ */
+enum class TraceEvent : uint32_t {
+    // A runnable got queued, arg is its ticket
+    Enqueue,
+    // A worker took a runnable from the queue, arg is its ticket
+    Dequeue,
+    // A worker started/finished running a runnable
+    RunStart,
+    RunEnd,
+    // A worker started/stopped waiting for a runnable
+    Park,
+    Unpark,
+    // A worker was created, arg is its id
+    Spawn,
+    // A worker was timed out, arg is its id
+    Timeout,
+    // A runnable was given straight to a parked worker, bypassing the queue
+    Handoff,
+};
+
+/**
+ * Runtime enabled tracing of the scheduler. Every thread records fixed-size
+ * events into its own ring, which only it writes, so recording is a relaxed
+ * load of the enabled flag when disabled and a clock read plus a few stores
+ * when enabled. The rings keep the most recent events and are dumped as
+ * Chrome/Perfetto trace JSON (chrome://tracing, ui.perfetto.dev).
+ *
+ * The rings of exited threads are kept, and reused by new threads, so that
+ * the memory stays bounded when the pool keeps respawning its workers.
+ */
+class Tracer
+{
+public:
+    // The number of events kept per thread, a power of two
+    static constexpr size_t ringSize = 1 << 13;
+
+    static void enable() { enabled.store(true, std::memory_order_relaxed); }
+    static void disable() { enabled.store(false, std::memory_order_relaxed); }
+    static bool isEnabled() { return enabled.load(std::memory_order_relaxed); }
+
+    static void record(TraceEvent type, uint64_t arg = 0)
+    {
+        if (!enabled.load(std::memory_order_relaxed)) {
+            return;
+        }
+        threadRing().push(type, arg, now());
+    }
+
+    /* Names the calling thread in the dumped traces. */
+    static void nameThread(std::string name)
+    {
+        Ring &ring = threadRing();
+        std::lock_guard<std::mutex> lock(registryMutex());
+        ring.name = std::move(name);
+    }
+
+    /**
+     * Writes the recorded events as Chrome trace JSON. Can be called while
+     * events are recorded, the events overwritten during the dump are skipped.
+     */
+    static void dumpChromeTrace(std::ostream &out)
+    {
+        std::vector<std::shared_ptr<Ring>> rings;
+        {
+            std::lock_guard<std::mutex> lock(registryMutex());
+            rings = registry();
+        }
+
+        out << "{\"traceEvents\":[";
+        bool first = true;
+        for (const auto &ring : rings) {
+            std::string name;
+            {
+                std::lock_guard<std::mutex> lock(registryMutex());
+                name = ring->name;
+            }
+            out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                << "\"tid\":" << ring->tid << ",\"args\":{\"name\":\""
+                << (name.empty() ? "thread " + std::to_string(ring->tid) : name) << "\"}}";
+            first = false;
+
+            for (const Record &record : ring->snapshot()) {
+                out << ",\n{\"name\":\"" << eventName(record.type) << "\",\"ph\":\""
+                    << eventPhase(record.type) << "\",\"pid\":1,\"tid\":" << record.tid
+                    << ",\"ts\":" << record.ts / 1000 << "." << record.ts % 1000 / 100
+                    << record.ts % 100 / 10 << record.ts % 10;
+                if (eventPhase(record.type) == 'i') {
+                    out << ",\"s\":\"t\"";
+                }
+                out << ",\"args\":{\"arg\":" << record.arg << "}}";
+            }
+        }
+        out << "\n]}\n";
+    }
+
+    /* Drops the recorded events. Only meant to be called while nothing records. */
+    static void clear()
+    {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        for (auto &ring : registry()) {
+            ring->head.store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    struct Record
+    {
+        // Nanoseconds since the epoch of steady_clock
+        uint64_t ts;
+        uint64_t arg;
+        uint32_t tid;
+        TraceEvent type;
+    };
+
+    /**
+     * A single producer ring of events. The fields are relaxed atomics so that
+     * a dump running concurrently with the owner isn't a data race, the head
+     * being read before and after to find out what was overwritten meanwhile.
+     */
+    struct Ring
+    {
+        struct Slot
+        {
+            std::atomic<uint64_t> ts{0};
+            std::atomic<uint64_t> arg{0};
+            std::atomic<uint32_t> type{0};
+        };
+
+        explicit Ring(uint32_t tid)
+            : tid(tid)
+        {}
+
+        void push(TraceEvent type, uint64_t arg, uint64_t ts)
+        {
+            uint64_t h = head.load(std::memory_order_relaxed);
+            Slot &slot = slots[h & (ringSize - 1)];
+            slot.ts.store(ts, std::memory_order_relaxed);
+            slot.arg.store(arg, std::memory_order_relaxed);
+            slot.type.store(static_cast<uint32_t>(type), std::memory_order_relaxed);
+            head.store(h + 1, std::memory_order_release);
+        }
+
+        std::vector<Record> snapshot() const
+        {
+            uint64_t end = head.load(std::memory_order_acquire);
+            uint64_t begin = end > ringSize ? end - ringSize : 0;
+            std::vector<Record> records;
+            records.reserve(end - begin);
+            for (uint64_t i = begin; i < end; ++i) {
+                const Slot &slot = slots[i & (ringSize - 1)];
+                records.push_back(Record{
+                    slot.ts.load(std::memory_order_relaxed),
+                    slot.arg.load(std::memory_order_relaxed),
+                    tid,
+                    static_cast<TraceEvent>(slot.type.load(std::memory_order_relaxed))});
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint64_t after = head.load(std::memory_order_relaxed);
+            if (after > begin + ringSize) {
+                size_t overwritten = std::min<uint64_t>(after - begin - ringSize, records.size());
+                records.erase(records.begin(), records.begin() + overwritten);
+            }
+            return records;
+        }
+
+        const uint32_t tid;
+        // Only written while holding the registry mutex
+        std::string name;
+        // Whether a live thread writes into the ring
+        bool owned = true;
+        std::atomic<uint64_t> head{0};
+        Slot slots[ringSize];
+    };
+
+    /**
+     * Gives the ring back to the registry when the thread exits.
+     */
+    struct Owner
+    {
+        std::shared_ptr<Ring> ring;
+
+        ~Owner()
+        {
+            if (ring) {
+                std::lock_guard<std::mutex> lock(registryMutex());
+                ring->owned = false;
+            }
+        }
+    };
+
+    static inline std::atomic<bool> enabled{false};
+
+    static std::mutex &registryMutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::vector<std::shared_ptr<Ring>> &registry()
+    {
+        static std::vector<std::shared_ptr<Ring>> rings;
+        return rings;
+    }
+
+    static Ring &threadRing()
+    {
+        static thread_local Owner owner;
+        if (!owner.ring) {
+            std::lock_guard<std::mutex> lock(registryMutex());
+            auto &rings = registry();
+            auto it = std::find_if(rings.begin(), rings.end(), [](const auto &ring) {
+                return !ring->owned;
+            });
+            if (it != rings.end()) {
+                owner.ring = *it;
+                owner.ring->owned = true;
+                owner.ring->name.clear();
+            } else {
+                owner.ring = std::make_shared<Ring>(rings.size() + 1);
+                rings.push_back(owner.ring);
+            }
+        }
+        return *owner.ring;
+    }
+
+    static uint64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    static const char *eventName(TraceEvent type)
+    {
+        switch (type) {
+        case TraceEvent::Enqueue:
+            return "enqueue";
+        case TraceEvent::Dequeue:
+            return "dequeue";
+        case TraceEvent::RunStart:
+        case TraceEvent::RunEnd:
+            return "run";
+        case TraceEvent::Park:
+            return "park";
+        case TraceEvent::Unpark:
+            return "unpark";
+        case TraceEvent::Spawn:
+            return "spawn";
+        case TraceEvent::Timeout:
+            return "timeout";
+        case TraceEvent::Handoff:
+            return "handoff";
+        }
+        return "unknown";
+    }
+
+    static char eventPhase(TraceEvent type)
+    {
+        switch (type) {
+        case TraceEvent::RunStart:
+            return 'B';
+        case TraceEvent::RunEnd:
+            return 'E';
+        default:
+            return 'i';
+        }
+    }
+};
+
+#endif // TRACING_H
@@ -0,0 +1,130 @@
+
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <pcosynchro/pcothread.h>
+
+#include "staticpool.h"
+
+// NOTE: a separate executable, replacing the global allocator would otherwise
+// run every other test on it
+
+//! Whether the allocations of the current thread are counted
+static thread_local bool countAllocations = false;
+
+//! The number of allocations made by the threads counting them
+static std::atomic<size_t> nbAllocations{0};
+
+void *operator new(std::size_t size)
+{
+    if (countAllocations) {
+        nbAllocations++;
+    }
+    if (void *ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+    ::operator delete(ptr);
+}
+
+///
+/// \brief A Runnable calling the given function
+class LambdaRunnable : public Runnable
+{
+    std::function<void()> m_run;
+
+public:
+    explicit LambdaRunnable(std::function<void()> run) : m_run(std::move(run)) {}
+
+    void run() override { m_run(); }
+
+    void cancelRun() override {}
+
+    std::string id() override { return "static"; }
+};
+
+///
+/// \brief A testcase with a static pool of 4 workers and room for 16 runnables
+/// The workers first each run a runnable that has them count their allocations.
+/// Check is done on nothing being allocated by the pool afterwards, whether it
+/// hands the runnables over, queues them or refuses them.
+///
+TEST(AllocationTest, testStaticPool)
+{
+    StaticThreadPool<4, 16> pool;
+    pool.lockMemory();
+
+    // NOTE: every worker has to take one of these, the others wait for it
+    std::atomic<int> nbCounting{0};
+    for (int i = 0; i < 4; i++) {
+        EXPECT_TRUE(pool.start(std::make_unique<LambdaRunnable>([&nbCounting] {
+            countAllocations = true;
+            nbCounting++;
+            while (nbCounting < 4) {
+                PcoThread::usleep(100);
+            }
+        })));
+    }
+    EXPECT_TRUE(pool.waitForDone());
+
+    std::atomic<int> nbRun{0};
+    std::atomic<bool> release{false};
+    std::vector<std::unique_ptr<Runnable>> runnables;
+    for (int i = 0; i < 200; i++) {
+        runnables.push_back(std::make_unique<LambdaRunnable>([&nbRun] { nbRun++; }));
+    }
+    std::vector<std::unique_ptr<Runnable>> blocking;
+    for (int i = 0; i < 4 + 16 + 1; i++) {
+        blocking.push_back(std::make_unique<LambdaRunnable>([&release] {
+            while (!release) {
+                PcoThread::usleep(100);
+            }
+        }));
+    }
+
+    countAllocations = true;
+    for (auto &runnable : runnables) {
+        EXPECT_TRUE(pool.start(std::move(runnable)));
+        if (pool.pendingCount() == pool.capacity()) {
+            EXPECT_TRUE(pool.waitForDone());
+        }
+    }
+    EXPECT_TRUE(pool.waitForDone());
+
+    for (int i = 0; i < 4; i++) {
+        EXPECT_TRUE(pool.start(std::move(blocking[i])));
+    }
+    while (pool.activeCount() < 4) {
+        PcoThread::usleep(100);
+    }
+    for (int i = 4; i < 4 + 16; i++) {
+        EXPECT_TRUE(pool.start(std::move(blocking[i])));
+    }
+    EXPECT_FALSE(pool.start(std::move(blocking.back())));
+    release = true;
+    EXPECT_TRUE(pool.waitForDone());
+    countAllocations = false;
+
+    EXPECT_EQ(nbAllocations, 0);
+    EXPECT_EQ(nbRun, 200);
+}
+
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,87 @@
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include <pcosynchro/pcothread.h>
+
+// NOTE: a separate executable, the pool is a different class with the
+// profiling on
+#define PROFILE_MONITOR 1
+#include "threadpool.h"
+
+///
+/// \brief A Runnable counting its runs
+class CountingRunnable : public Runnable
+{
+    std::atomic<int> &m_nbRun;
+
+public:
+    explicit CountingRunnable(std::atomic<int> &nbRun) : m_nbRun(nbRun) {}
+
+    void run() override { m_nbRun++; }
+
+    void cancelRun() override {}
+
+    std::string id() override { return "profiled"; }
+};
+
+/// Starts runnables one by one on a pool with the given sync backend, each
+/// waking a parked worker up, and returns the profile of the Start site.
+template<typename SyncPolicy>
+MonitorSiteProfile profileStarts()
+{
+    BasicThreadPool<IndexedQueue, SyncPolicy> pool(2, 100, std::chrono::milliseconds{1000});
+    std::atomic<int> nbRun{0};
+    for (int i = 0; i < 20; i++) {
+        EXPECT_TRUE(pool.start(std::make_unique<CountingRunnable>(nbRun)));
+        EXPECT_TRUE(pool.waitForDone());
+        while (pool.idleCount() < pool.currentNbThreads()) {
+            PcoThread::usleep(100);
+        }
+    }
+    EXPECT_EQ(nbRun, 20);
+    return pool.monitorProfile()[static_cast<size_t>(MonitorSite::Start)];
+}
+
+///
+/// \brief A testcase profiling the monitor of pools with Hoare and Mesa semantics
+/// Check is done on every entry of the Start site being recorded, and on its
+/// hold time being split by signal() with Hoare semantics only.
+///
+TEST(MonitorProfileTest, testSignalSplit)
+{
+    MonitorSiteProfile hoare = profileStarts<HoareSync>();
+    EXPECT_EQ(hoare.acquire.count(), 20);
+    EXPECT_GT(hoare.hold.count(), hoare.acquire.count());
+
+    MonitorSiteProfile mesa = profileStarts<MesaSync>();
+    EXPECT_EQ(mesa.acquire.count(), 20);
+    EXPECT_EQ(mesa.hold.count(), mesa.acquire.count());
+
+    MonitorSiteProfile futex = profileStarts<FutexSync>();
+    EXPECT_EQ(futex.hold.count(), futex.acquire.count());
+}
+
+///
+/// \brief A testcase computing the contention ratio of a site
+/// Check is done on the ratio following the exact sums of the durations rather
+/// than their rounded means.
+///
+TEST(MonitorProfileTest, testContentionRatio)
+{
+    MonitorSiteProfile profile;
+    EXPECT_EQ(profile.contentionRatio(), 0.0);
+    profile.acquire.record(1);
+    profile.acquire.record(2);
+    profile.hold.record(3);
+    EXPECT_DOUBLE_EQ(profile.contentionRatio(), 0.5);
+}
+
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
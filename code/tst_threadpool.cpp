@@ -1,11 +1,29 @@
 
+#include <atomic>
 #include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <memory_resource>
+#include <set>
+#include <sstream>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <gtest/gtest.h>
 
 #include <pcosynchro/pcologger.h>
 #include <pcosynchro/pcothread.h>
 
+#include "numa.h"
+#include "objectpool.h"
+#include "pipeline.h"
+#include "staticpool.h"
+#include "taskgraph.h"
 #include "threadpool.h"
 
 
@@ -167,6 +185,64 @@ public:
 };
 
 
+///
+/// \brief The FunctionRunnable class
+/// A Runnable calling the given functions, used by the testcases that need a
+/// specific behaviour from their Runnables
+class FunctionRunnable : public Runnable
+{
+    //! The Id of the Runnable
+    std::string m_id;
+
+    //! Called by run()
+    std::function<void()> m_run;
+
+    //! Called by cancelRun()
+    std::function<void()> m_cancel;
+
+public:
+    FunctionRunnable(std::string id, std::function<void()> run, std::function<void()> cancel = {})
+        : m_id(std::move(id)), m_run(std::move(run)), m_cancel(std::move(cancel)) {
+    }
+
+    void run() override {
+        m_run();
+    }
+
+    std::string id() override {
+        return m_id;
+    }
+
+    void cancelRun() override {
+        if (m_cancel) {
+            m_cancel();
+        }
+    }
+};
+
+/// A Runnable incrementing a counter, recycled through ObjectPool
+class RecycledRunnable : public Runnable, public Recyclable<RecycledRunnable>
+{
+    //! Incremented by run()
+    std::atomic<int> &m_counter;
+
+public:
+    explicit RecycledRunnable(std::atomic<int> &counter) : m_counter(counter) {
+    }
+
+    void run() override {
+        m_counter++;
+    }
+
+    std::string id() override {
+        return "recycled";
+    }
+
+    void cancelRun() override {
+    }
+};
+
+
 typedef struct {
     int thread_id;
     std::unique_ptr<TestRunnable> runnable;
@@ -396,6 +472,1314 @@ TEST_F(ThreadpoolTest, testCase5)
     }
 }
 
+///
+/// \brief A pool for Pipeline::run() keeping the runnables it accepts for the
+/// test to run, and refusing them once told so
+class RefusingPool
+{
+public:
+    bool start(std::unique_ptr<Runnable> runnable)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (refusing) {
+            lock.unlock();
+            runnable->cancelRun();
+            return false;
+        }
+        accepted.push_back(std::move(runnable));
+        return true;
+    }
+
+    std::mutex mutex;
+    bool refusing = false;
+    std::vector<std::unique_ptr<Runnable>> accepted;
+};
+
+///
+/// \brief A pipeline whose serial sink gets every token parked but the first
+/// The tokens are run last to first, then the pool refuses the ones the sink
+/// releases, each being processed by the thread releasing it.
+/// Check is done on the order in which the sink receives the tokens, which
+/// takes 100000 refusals in a row without running out of stack.
+///
+TEST_F(ThreadpoolTest, testPipelineRefusals)
+{
+    constexpr int nbTokens = 100000;
+    RefusingPool pool;
+    std::vector<int> output;
+
+    int next = 0;
+    auto chain = makeSource<int>([&]() -> std::optional<int> {
+                     if (next == nbTokens) {
+                         return std::nullopt;
+                     }
+                     return next++;
+                 })
+                 & makeStage<int, void>(
+                     StageMode::SerialInOrder, [&output](int value) { output.push_back(value); });
+    Pipeline pipeline(std::move(chain), nbTokens);
+
+    std::thread runner([&pool] {
+        std::vector<std::unique_ptr<Runnable>> runnables;
+        while (runnables.size() < nbTokens) {
+            PcoThread::usleep(100);
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            if (pool.accepted.size() == nbTokens) {
+                runnables = std::move(pool.accepted);
+                pool.refusing = true;
+            }
+        }
+        for (auto it = runnables.rbegin(); it != runnables.rend(); ++it) {
+            (*it)->run();
+        }
+    });
+    pipeline.run(pool);
+    runner.join();
+
+    ASSERT_EQ(output.size(), nbTokens);
+    for (int i = 0; i < nbTokens; i++) {
+        EXPECT_EQ(output[i], i) << "Tokens reordered";
+    }
+}
+
+///
+/// \brief A pipeline of a parallel stage between a source and a serial sink
+/// Check is done on the order in which the sink receives the tokens and on
+/// the number of tokens in flight never exceeding the requested cap.
+///
+TEST_F(ThreadpoolTest, testPipeline)
+{
+    ThreadPool pool(4, 16, std::chrono::milliseconds{100});
+
+    constexpr int nbTokens = 200;
+    constexpr size_t maxTokens = 6;
+    std::atomic<size_t> inFlight{0};
+    std::atomic<size_t> maxInFlight{0};
+    std::vector<int> output;
+
+    int next = 0;
+    auto chain = makeSource<int>([&]() -> std::optional<int> {
+                     if (next == nbTokens) {
+                         return std::nullopt;
+                     }
+                     size_t current = ++inFlight;
+                     size_t seen = maxInFlight;
+                     while (current > seen && !maxInFlight.compare_exchange_weak(seen, current)) {
+                     }
+                     return next++;
+                 })
+                 & makeStage<int, std::unique_ptr<int>>(StageMode::Parallel, [](int value) {
+                       PcoThread::usleep(100 * (value % 3));
+                       return std::make_unique<int>(value * 2);
+                   })
+                 & makeStage<std::unique_ptr<int>, void>(
+                     StageMode::SerialInOrder, [&](std::unique_ptr<int> value) {
+                         output.push_back(*value);
+                         --inFlight;
+                     });
+
+    Pipeline pipeline(std::move(chain), maxTokens);
+    pipeline.run(pool);
+
+    ASSERT_EQ(output.size(), nbTokens);
+    for (int i = 0; i < nbTokens; i++) {
+        EXPECT_EQ(output[i], 2 * i) << "Tokens reordered";
+    }
+    EXPECT_LE(maxInFlight, maxTokens) << "Too many tokens in flight";
+}
+
+///
+/// \brief A diamond shaped task graph run several times on the same pool
+/// Check is done on every node running once per run and never before its
+/// predecessors.
+///
+TEST_F(ThreadpoolTest, testTaskGraph)
+{
+    ThreadPool pool(4, 2, std::chrono::milliseconds{100});
+
+    constexpr int nbRuns = 100;
+    constexpr int width = 8;
+    std::atomic<int> sourceRuns{0};
+    std::atomic<int> middleRuns{0};
+    std::atomic<int> sinkRuns{0};
+    std::atomic<int> misordered{0};
+
+    TaskGraph graph;
+    TaskGraph::NodeId source = graph.addNode([&]() { ++sourceRuns; });
+    TaskGraph::NodeId sink = graph.addNode([&]() {
+        if (middleRuns != sourceRuns * width) {
+            ++misordered;
+        }
+        ++sinkRuns;
+    });
+    for (int i = 0; i < width; i++) {
+        TaskGraph::NodeId middle = graph.addNode([&]() {
+            if (sourceRuns != sinkRuns + 1) {
+                ++misordered;
+            }
+            ++middleRuns;
+        });
+        graph.addEdge(source, middle);
+        graph.addEdge(middle, sink);
+    }
+
+    for (int run = 0; run < nbRuns; run++) {
+        graph.run(pool);
+    }
+
+    EXPECT_EQ(sourceRuns, nbRuns);
+    EXPECT_EQ(middleRuns, nbRuns * width);
+    EXPECT_EQ(sinkRuns, nbRuns);
+    EXPECT_EQ(misordered, 0) << "A node ran before its predecessors";
+}
+
+///
+/// \brief A testcase with a pool of a single thread kept busy while runnables
+/// pile up in the queue. Part of them are then cancelled by id, by group and
+/// through their token before the running one is cancelled as well.
+/// Check is done on which runnables ran and which ones were cancelled.
+///
+TEST_F(ThreadpoolTest, testCancellation)
+{
+    ThreadPool pool(1, 20, std::chrono::milliseconds{100});
+    std::atomic<bool> blockerStarted{false};
+    std::atomic<bool> blockerCancelled{false};
+    std::atomic<int> nbRun{0};
+    std::atomic<int> nbCancelled{0};
+
+    auto count = [&]() { ++nbRun; };
+    auto cancelled = [&]() { ++nbCancelled; };
+
+    EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("blocker", [&]() {
+        blockerStarted = true;
+        for (int i = 0; i < 1000 && !ThreadPool::isCancelled(); i++) {
+            PcoThread::usleep(1000);
+        }
+        blockerCancelled = ThreadPool::isCancelled();
+    })));
+    while (!blockerStarted) {
+        PcoThread::usleep(100);
+    }
+    EXPECT_FALSE(ThreadPool::isCancelled());
+
+    CancellationToken token = CancellationToken::create();
+    for (int i = 0; i < 4; i++) {
+        EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("byId", count, cancelled)));
+        EXPECT_TRUE(
+            pool.start(std::make_unique<FunctionRunnable>("kept", count, cancelled), {}, "keep"));
+        EXPECT_TRUE(pool.start(
+            std::make_unique<FunctionRunnable>("byGroup" + std::to_string(i), count, cancelled),
+            {},
+            "group"));
+        EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("byToken", count, cancelled), token));
+    }
+
+    EXPECT_EQ(pool.cancel("byId"), 4);
+    EXPECT_EQ(pool.cancel("byId"), 0);
+    EXPECT_EQ(pool.cancelGroup("group"), 4);
+    EXPECT_EQ(nbCancelled, 8);
+    token.cancel();
+
+    EXPECT_EQ(pool.cancel("blocker"), 0);
+    EXPECT_TRUE(pool.waitForDone(std::chrono::milliseconds{1000}));
+
+    EXPECT_TRUE(blockerCancelled);
+    EXPECT_EQ(nbRun, 4) << "Only the runnables of the kept group should have run";
+    EXPECT_EQ(nbCancelled, 12);
+}
+
+///
+/// \brief A testcase shutting down pools with a backlog of runnables
+/// Check is done on the number of cancelled and drained runnables for the
+/// cancel-pending and deadline modes, and on runnables being refused afterwards.
+///
+TEST_F(ThreadpoolTest, testShutdown)
+{
+    std::atomic<int> nbRun{0};
+    std::atomic<int> nbCancelled{0};
+    auto count = [&]() { ++nbRun; PcoThread::usleep(10000); };
+    auto cancelled = [&]() { ++nbCancelled; };
+
+    {
+        ThreadPool pool(2, 100, std::chrono::milliseconds{100});
+        for (int i = 0; i < 2; i++) {
+            EXPECT_TRUE(pool.start(
+                std::make_unique<FunctionRunnable>("long", [] { PcoThread::usleep(50000); })));
+        }
+        PcoThread::usleep(10000);
+        for (int i = 0; i < 50; i++) {
+            EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("short", count, cancelled)));
+        }
+
+        auto begin = std::chrono::steady_clock::now();
+        ShutdownResult result = pool.shutdown(ShutdownMode::CancelPending);
+        auto elapsed = std::chrono::steady_clock::now() - begin;
+
+        EXPECT_EQ(result.cancelled, 50);
+        EXPECT_EQ(result.drained, 0);
+        EXPECT_FALSE(result.timedOut);
+        EXPECT_EQ(nbRun, 0);
+        EXPECT_LT(elapsed, std::chrono::milliseconds{100 + 50}) << "Waited for the queue";
+        EXPECT_FALSE(pool.start(std::make_unique<FunctionRunnable>("late", count, cancelled)));
+        EXPECT_EQ(nbCancelled, 51);
+    }
+
+    nbRun = 0;
+    nbCancelled = 0;
+    {
+        ThreadPool pool(1, 100, std::chrono::milliseconds{100});
+        EXPECT_TRUE(pool.start(
+            std::make_unique<FunctionRunnable>("long", [] { PcoThread::usleep(20000); })));
+        PcoThread::usleep(5000);
+        for (int i = 0; i < 50; i++) {
+            EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("short", count, cancelled)));
+        }
+
+        ShutdownResult result = pool.shutdown(
+            ShutdownMode::Deadline, std::chrono::steady_clock::now() + std::chrono::milliseconds{200});
+
+        EXPECT_TRUE(result.timedOut);
+        EXPECT_GT(result.drained, 0);
+        EXPECT_GT(result.cancelled, 0);
+        EXPECT_EQ(result.drained + result.cancelled, 50);
+        EXPECT_EQ(nbRun, result.drained);
+        EXPECT_EQ(nbCancelled, result.cancelled);
+    }
+}
+
+///
+/// \brief A testcase waiting for the completion of the runnables instead of
+/// sleeping for a fixed amount of time
+/// Check is done on the pending and active counts, on waitForDone() timing out
+/// while runnables are left and on it returning once they are all done.
+///
+TEST_F(ThreadpoolTest, testWaitForDone)
+{
+    initTestCase();
+    ThreadPool pool(5, 100, std::chrono::milliseconds{100});
+
+    EXPECT_TRUE(pool.waitForDone(std::chrono::milliseconds{0}));
+
+    for (int i = 0; i < 20; i++) {
+        std::string runnableId = "Run" + std::to_string(i);
+        runnableStarted(runnableId);
+        EXPECT_TRUE(pool.start(std::make_unique<TestRunnable>(this, runnableId, RUNTIME / 10)));
+    }
+
+    EXPECT_GT(pool.pendingCount(), 0);
+    EXPECT_LE(pool.activeCount(), 5);
+    EXPECT_FALSE(pool.waitForDone(std::chrono::milliseconds{1}));
+    EXPECT_TRUE(pool.waitForDone());
+
+    EXPECT_EQ(pool.pendingCount(), 0);
+    EXPECT_EQ(pool.activeCount(), 0);
+    EXPECT_EQ(pool.currentNbThreads(), 5);
+    for (const auto& [key, value] : m_runningState) {
+        EXPECT_EQ(value, false) << "Failed";
+    }
+    EXPECT_GE(std::chrono::duration_cast<std::chrono::milliseconds>(endingTime - startingTime).count(), 4 * RUNTIMEINMS / 10) << "Too short execution time";
+}
+
+///
+/// \brief A testcase checking the statistics of a pool after a known workload
+/// Check is done on the task counts, the queue high-water mark, the number of
+/// rejected runnables and the run time histogram.
+///
+TEST_F(ThreadpoolTest, testStats)
+{
+    ThreadPool pool(2, 10, std::chrono::milliseconds{100});
+
+    int nbAccepted = 0;
+    for (int i = 0; i < 15; i++) {
+        if (pool.start(std::make_unique<FunctionRunnable>("stats", [] { PcoThread::usleep(5000); }))) {
+            nbAccepted++;
+        }
+    }
+    EXPECT_TRUE(pool.waitForDone());
+
+    ThreadPoolStats stats = pool.stats();
+    EXPECT_EQ(stats.tasks, nbAccepted);
+    EXPECT_EQ(stats.rejected, 15 - nbAccepted);
+    EXPECT_GE(stats.rejected, 3);
+    EXPECT_EQ(stats.queueDepth, 0);
+    EXPECT_EQ(stats.queueHighWater, 10);
+    ASSERT_EQ(stats.workers.size(), 2);
+    EXPECT_EQ(stats.workers[0].tasks + stats.workers[1].tasks, stats.tasks);
+    EXPECT_EQ(stats.runTime.count(), stats.tasks);
+    EXPECT_EQ(stats.queueWait.count(), stats.tasks);
+    EXPECT_GE(stats.runTime.percentile(0.5), 5000000);
+    EXPECT_LT(stats.runTime.percentile(0.5), 20000000);
+    EXPECT_GE(stats.busyNs, stats.tasks * 5000000);
+    EXPECT_GT(stats.utilization(), 0.0);
+}
+
+///
+/// \brief A testcase tracing a short workload
+/// Check is done on the dumped Chrome trace containing a run slice per
+/// runnable and the other scheduler events.
+///
+TEST_F(ThreadpoolTest, testTracing)
+{
+    Tracer::clear();
+    Tracer::enable();
+    {
+        ThreadPool pool(2, 10, std::chrono::milliseconds{5});
+        for (int i = 0; i < 8; i++) {
+            EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("traced", [] { PcoThread::usleep(1000); })));
+        }
+        EXPECT_TRUE(pool.waitForDone());
+        PcoThread::usleep(50000);
+    }
+    Tracer::disable();
+
+    std::ostringstream trace;
+    Tracer::dumpChromeTrace(trace);
+    std::string json = trace.str();
+
+    auto count = [&json](const std::string &pattern) {
+        size_t nb = 0;
+        for (size_t pos = json.find(pattern); pos != std::string::npos; pos = json.find(pattern, pos + 1)) {
+            nb++;
+        }
+        return nb;
+    };
+    EXPECT_EQ(json.rfind("{\"traceEvents\":[", 0), 0);
+    EXPECT_EQ(count("\"name\":\"run\",\"ph\":\"B\""), 8);
+    EXPECT_EQ(count("\"name\":\"run\",\"ph\":\"E\""), 8);
+    EXPECT_EQ(count("\"name\":\"enqueue\"") + count("\"name\":\"handoff\""), 8);
+    EXPECT_EQ(count("\"name\":\"dequeue\""), count("\"name\":\"enqueue\""));
+    EXPECT_EQ(count("\"name\":\"spawn\""), 2);
+    EXPECT_EQ(count("\"name\":\"timeout\""), 2);
+    EXPECT_GE(count("\"name\":\"worker "), 2);
+}
+
+///
+/// \brief A testcase timing out the workers over and over with a virtual clock
+/// Check is done on the workers surviving until the very end of their idle
+/// timeout and being retired as soon as it is reached, 200 times, which takes
+/// 200 s of virtual time.
+///
+TEST_F(ThreadpoolTest, testVirtualTime)
+{
+    auto clock = std::make_shared<ManualClock>();
+    ThreadPool pool(4, 16, std::chrono::milliseconds{1000}, clock);
+
+    std::atomic<int> nbRun{0};
+    for (int round = 0; round < 200; round++) {
+        for (int i = 0; i < 4; i++) {
+            EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("virtual", [&nbRun] { nbRun++; })));
+        }
+        EXPECT_TRUE(pool.waitForDone());
+        size_t nbThreads = pool.currentNbThreads();
+        ASSERT_GT(nbThreads, 0);
+        while (pool.idleCount() < nbThreads) {
+            PcoThread::usleep(100);
+        }
+        clock->waitForSleepers(1);
+
+        clock->advance(std::chrono::milliseconds{999});
+        clock->waitForSleepers(1);
+        EXPECT_EQ(pool.currentNbThreads(), nbThreads);
+
+        clock->advance(std::chrono::milliseconds{1});
+        while (pool.currentNbThreads() > 0) {
+            PcoThread::usleep(100);
+        }
+    }
+    EXPECT_EQ(nbRun, 800);
+    EXPECT_EQ(pool.stats().tasks, 800);
+}
+
+///
+/// \brief A testcase accounting the time of spinning and sleeping runnables
+/// Check is done on the ids being aggregated by prefix, on the CPU time of the
+/// spinning ones and the off-CPU time of the sleeping ones, and on the dump.
+///
+TEST_F(ThreadpoolTest, testAccounting)
+{
+    ThreadPool pool(2, 20, std::chrono::milliseconds{100});
+    pool.accounting().setDelimiter(':');
+    pool.accounting().enable();
+
+    for (int i = 0; i < 5; i++) {
+        EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("spin:" + std::to_string(i), [] {
+            uint64_t begin = TaskAccounting::threadCpuNs();
+            while (TaskAccounting::threadCpuNs() - begin < 2000000) {
+            }
+        })));
+        EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("sleep:" + std::to_string(i), [] {
+            PcoThread::usleep(5000);
+        })));
+    }
+    EXPECT_TRUE(pool.waitForDone());
+
+    std::vector<TaskAccount> accounts = pool.accounting().snapshot();
+    ASSERT_EQ(accounts.size(), 2);
+    EXPECT_EQ(accounts[0].key, "spin");
+    EXPECT_EQ(accounts[0].count, 5);
+    EXPECT_GE(accounts[0].cpuNs, 5 * 2000000);
+    EXPECT_EQ(accounts[1].key, "sleep");
+    EXPECT_EQ(accounts[1].count, 5);
+    EXPECT_GE(accounts[1].wallNs, 5 * 5000000);
+    EXPECT_GT(accounts[1].offCpuNs(), accounts[1].cpuNs);
+
+    std::ostringstream csv;
+    pool.accounting().dumpCsv(csv);
+    EXPECT_EQ(csv.str().rfind("key,count,wall_ns,cpu_ns,off_cpu_ns,", 0), 0);
+    EXPECT_NE(csv.str().find("\nspin,5,"), std::string::npos);
+
+    pool.accounting().disable();
+    EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("other", [] {})));
+    EXPECT_TRUE(pool.waitForDone());
+    EXPECT_EQ(pool.accounting().snapshot().size(), 2);
+}
+
+///
+/// \brief A testcase accounting the perf counters of sleeping runnables
+/// Check is done on the context switches of each sleep being attributed to
+/// the runnables, when the software counters are available at all.
+///
+TEST_F(ThreadpoolTest, testPerfCounters)
+{
+    if (!PerfCounters().isOpen()) {
+        GTEST_SKIP() << "perf_event_open is not available";
+    }
+
+    ThreadPool pool(2, 20, std::chrono::milliseconds{100});
+    pool.accounting().enable(true);
+    for (int i = 0; i < 10; i++) {
+        EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("sleep", [] {
+            PcoThread::usleep(1000);
+        })));
+    }
+    EXPECT_TRUE(pool.waitForDone());
+
+    std::vector<TaskAccount> accounts = pool.accounting().snapshot();
+    ASSERT_EQ(accounts.size(), 1);
+    EXPECT_EQ(accounts[0].count, 10);
+    EXPECT_GE(accounts[0].perf.contextSwitches, 10);
+    if (PerfCounters().hasHardware()) {
+        EXPECT_GT(accounts[0].perf.instructions, 0);
+        EXPECT_GT(accounts[0].perf.cycles, 0);
+    }
+}
+
+///
+/// \brief A testcase watching a slow runnable among fast ones
+/// Check is done on the live state of the workers while it runs and on the
+/// watchdog reporting it, and it only, exactly once.
+///
+TEST_F(ThreadpoolTest, testWatchdog)
+{
+    ThreadPool pool(2, 20, std::chrono::milliseconds{100});
+    std::mutex stalledMutex;
+    std::vector<WorkerState> stalled;
+    pool.startWatchdog(std::chrono::milliseconds{20}, [&](const WorkerState &state) {
+        std::lock_guard<std::mutex> lock(stalledMutex);
+        stalled.push_back(state);
+    });
+
+    std::atomic<bool> release{false};
+    EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("slow", [&release] {
+        while (!release) {
+            PcoThread::usleep(1000);
+        }
+    })));
+    for (int i = 0; i < 10; i++) {
+        EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("fast", [] { PcoThread::usleep(1000); })));
+    }
+    PcoThread::usleep(60000);
+
+    std::vector<WorkerState> states = pool.workerStates();
+    ASSERT_EQ(states.size(), 2);
+    size_t nbSlow = 0;
+    for (const WorkerState &state : states) {
+        if (state.running && state.task == "slow") {
+            nbSlow++;
+            EXPECT_GE(state.elapsed, std::chrono::milliseconds{50});
+            EXPECT_EQ(state.started, 1);
+        }
+    }
+    EXPECT_EQ(nbSlow, 1);
+
+    release = true;
+    EXPECT_TRUE(pool.waitForDone());
+    pool.stopWatchdog();
+    for (const WorkerState &state : pool.workerStates()) {
+        EXPECT_FALSE(state.running);
+        EXPECT_TRUE(state.task.empty());
+    }
+    ASSERT_EQ(stalled.size(), 1);
+    EXPECT_EQ(stalled[0].task, "slow");
+    EXPECT_GE(stalled[0].elapsed, std::chrono::milliseconds{20});
+}
+
+///
+/// \brief A testcase logging from several runnables through the AsyncLogger
+/// Check is done on every record being written once the pool is shut down
+/// when blocking on overflow, and on every record being either written or
+/// counted as dropped otherwise.
+///
+TEST_F(ThreadpoolTest, testAsyncLogger)
+{
+    FILE *file = tmpfile();
+    ASSERT_NE(file, nullptr);
+    AsyncLogger &logger = AsyncLogger::instance();
+    logger.setOutput(fileno(file));
+
+    auto logFrom = [](ThreadPool &pool, int nbTasks, int nbRecords) {
+        for (int i = 0; i < nbTasks; i++) {
+            EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("log", [nbRecords, i] {
+                for (int j = 0; j < nbRecords; j++) {
+                    AsyncLog() << "task " << i << " record " << j << " " << std::string(64, 'x') << std::endl;
+                }
+            })));
+        }
+    };
+    auto countLines = [file]() {
+        size_t nb = 0;
+        rewind(file);
+        for (int c = fgetc(file); c != EOF; c = fgetc(file)) {
+            nb += c == '\n';
+        }
+        return nb;
+    };
+
+    logger.setOverflow(LogOverflow::Block);
+    {
+        ThreadPool pool(4, 20, std::chrono::milliseconds{100});
+        logFrom(pool, 8, 5000);
+    }
+    EXPECT_EQ(countLines(), 8 * 5000);
+
+    logger.setOverflow(LogOverflow::Drop);
+    uint64_t dropped = logger.dropped();
+    {
+        ThreadPool pool(4, 20, std::chrono::milliseconds{100});
+        logFrom(pool, 8, 5000);
+    }
+    EXPECT_EQ(countLines() + logger.dropped() - dropped, 2 * 8 * 5000);
+
+    logger.setOverflow(LogOverflow::Block);
+    logger.setOutput(STDOUT_FILENO);
+    fclose(file);
+}
+
+///
+/// \brief A testcase with workers spinning before they park
+/// Check is done on a worker spinning instead of parking right after its
+/// task, on it taking the next runnable without another worker being
+/// spawned, and on the number of spinning workers being capped.
+///
+TEST_F(ThreadpoolTest, testIdleSpin)
+{
+    ThreadPool pool(3, 10, std::chrono::milliseconds{1000});
+    pool.setIdleSpin(1, std::chrono::milliseconds{500});
+
+    std::atomic<int> nbRun{0};
+    EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("spin", [&nbRun] { nbRun++; })));
+    EXPECT_TRUE(pool.waitForDone());
+    PcoThread::usleep(10000);
+    EXPECT_EQ(pool.currentNbThreads(), 1);
+    EXPECT_EQ(pool.idleCount(), 0) << "The worker should be spinning, not parked";
+
+    EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("spin", [&nbRun] { nbRun++; })));
+    EXPECT_TRUE(pool.waitForDone());
+    EXPECT_EQ(pool.currentNbThreads(), 1);
+    EXPECT_EQ(nbRun, 2);
+
+    std::atomic<bool> release{false};
+    for (int i = 0; i < 3; i++) {
+        EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("block", [&release] {
+            while (!release) {
+                PcoThread::usleep(1000);
+            }
+        })));
+    }
+    while (pool.activeCount() < 3) {
+        PcoThread::usleep(1000);
+    }
+    release = true;
+    EXPECT_TRUE(pool.waitForDone());
+    PcoThread::usleep(20000);
+    EXPECT_EQ(pool.currentNbThreads(), 3);
+    EXPECT_GE(pool.idleCount(), 2) << "Only one worker may spin";
+}
+
+///
+/// \brief A testcase starting runnables one at a time on a parked worker
+/// Check is done on the runnables being handed over to the worker without
+/// ever going through the queue, but for the first one which spawns it.
+///
+TEST_F(ThreadpoolTest, testHandOff)
+{
+    ThreadPool pool(2, 10, std::chrono::milliseconds{1000});
+    pool.setIdleSpin(0, std::chrono::nanoseconds{0});
+
+    std::atomic<int> nbRun{0};
+    for (int i = 0; i < 20; i++) {
+        EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("handoff", [&nbRun] { nbRun++; })));
+        EXPECT_TRUE(pool.waitForDone());
+        while (pool.idleCount() < pool.currentNbThreads()) {
+            PcoThread::usleep(100);
+        }
+    }
+
+    ThreadPoolStats stats = pool.stats();
+    EXPECT_EQ(nbRun, 20);
+    EXPECT_EQ(stats.tasks, 20);
+    EXPECT_EQ(stats.queueHighWater, 1);
+    EXPECT_EQ(stats.queueWait.count(), 20);
+    EXPECT_EQ(pool.currentNbThreads(), 1);
+}
+
+/// Runs rounds of runnables on a pool with the given sync backend, each round
+/// ending with the workers timing out, then drains a full queue on shutdown.
+template<typename SyncPolicy>
+void checkSyncPolicy()
+{
+    auto clock = std::make_shared<ManualClock>();
+    BasicThreadPool<IndexedQueue, SyncPolicy> pool(4, 64, std::chrono::milliseconds{1000}, clock);
+
+    std::atomic<int> nbRun{0};
+    for (int round = 0; round < 20; round++) {
+        for (int i = 0; i < 10; i++) {
+            EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("sync", [&nbRun] {
+                PcoThread::usleep(100);
+                nbRun++;
+            })));
+        }
+        EXPECT_TRUE(pool.waitForDone());
+        size_t nbThreads = pool.currentNbThreads();
+        while (pool.idleCount() < nbThreads) {
+            PcoThread::usleep(100);
+        }
+        clock->waitForSleepers(1);
+        clock->advance(std::chrono::milliseconds{1000});
+        while (pool.currentNbThreads() > 0) {
+            PcoThread::usleep(100);
+        }
+    }
+    EXPECT_EQ(nbRun, 200);
+
+    for (int i = 0; i < 64; i++) {
+        EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("sync", [&nbRun] { nbRun++; })));
+    }
+    pool.shutdown(ShutdownMode::Drain);
+    EXPECT_EQ(nbRun, 264);
+    EXPECT_EQ(pool.stats().tasks, 264);
+}
+
+///
+/// \brief A testcase running the same workload on every sync backend
+/// Check is done on every runnable being run and every worker timing out
+/// whether the monitor has Hoare or Mesa semantics.
+///
+TEST_F(ThreadpoolTest, testSyncPolicies)
+{
+    checkSyncPolicy<HoareSync>();
+    checkSyncPolicy<MesaSync>();
+    checkSyncPolicy<FutexSync>();
+}
+
+///
+/// \brief A testcase with a pool of 4 workers started upfront, without stats
+/// Check is done on the workers outliving the idle timeout, on the runnables
+/// cancelled through their token and on the drain of the shutdown.
+///
+TEST_F(ThreadpoolTest, testFixedPool)
+{
+    FixedThreadPool pool(4, 64, std::chrono::milliseconds{1});
+    EXPECT_EQ(pool.currentNbThreads(), 4);
+
+    std::atomic<int> nbRun{0};
+    std::atomic<int> nbCancelled{0};
+    for (int round = 0; round < 10; round++) {
+        auto token = CancellationToken::create();
+        token.cancel();
+        EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>(
+                                   "fixed", [&nbRun] { nbRun++; }, [&nbCancelled] { nbCancelled++; }),
+                               token));
+        for (int i = 0; i < 10; i++) {
+            EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("fixed", [&nbRun] { nbRun++; })));
+        }
+        EXPECT_TRUE(pool.waitForDone());
+        PcoThread::usleep(5000);
+        EXPECT_EQ(pool.currentNbThreads(), 4);
+    }
+    EXPECT_EQ(nbRun, 100);
+    EXPECT_EQ(nbCancelled, 10);
+
+    // NOTE: nothing reads the ids until the accounting is enabled
+    class IdCountingRunnable : public FunctionRunnable
+    {
+        std::atomic<int> &m_nbIds;
+
+    public:
+        explicit IdCountingRunnable(std::atomic<int> &nbIds)
+            : FunctionRunnable("fixed", [] {}), m_nbIds(nbIds) {}
+
+        std::string id() override {
+            m_nbIds++;
+            return FunctionRunnable::id();
+        }
+    };
+    std::atomic<int> nbIds{0};
+    for (int i = 0; i < 10; i++) {
+        EXPECT_TRUE(pool.start(std::make_unique<IdCountingRunnable>(nbIds)));
+    }
+    EXPECT_TRUE(pool.waitForDone());
+    EXPECT_EQ(nbIds, 0);
+    pool.accounting().enable();
+    EXPECT_TRUE(pool.start(std::make_unique<IdCountingRunnable>(nbIds)));
+    EXPECT_TRUE(pool.waitForDone());
+    EXPECT_EQ(nbIds, 1);
+    pool.accounting().disable();
+
+    for (int i = 0; i < 64; i++) {
+        EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("fixed", [&nbRun] { nbRun++; })));
+    }
+    pool.shutdown(ShutdownMode::Drain);
+    EXPECT_EQ(nbRun, 164);
+    EXPECT_EQ(pool.currentNbThreads(), 0);
+}
+
+///
+/// \brief A testcase with a static pool of 4 workers and room for 16 runnables
+/// Check is done on the runnables refused once the ring is full and on the
+/// drain of the shutdown. That the pool doesn't allocate is checked by
+/// tst_allocations.cpp.
+///
+TEST_F(ThreadpoolTest, testStaticPool)
+{
+    StaticThreadPool<4, 16> pool;
+    EXPECT_EQ(pool.currentNbThreads(), 4);
+    pool.lockMemory();
+
+    std::atomic<int> nbRun{0};
+    std::atomic<bool> release{false};
+    std::vector<std::unique_ptr<Runnable>> runnables;
+    for (int i = 0; i < 200; i++) {
+        runnables.push_back(std::make_unique<FunctionRunnable>("static", [&nbRun] { nbRun++; }));
+    }
+    std::vector<std::unique_ptr<Runnable>> blocking;
+    for (int i = 0; i < 4 + 16 + 1; i++) {
+        blocking.push_back(std::make_unique<FunctionRunnable>("static", [&release] {
+            while (!release) {
+                PcoThread::usleep(100);
+            }
+        }));
+    }
+
+    for (auto &runnable : runnables) {
+        EXPECT_TRUE(pool.start(std::move(runnable)));
+        if (pool.pendingCount() == pool.capacity()) {
+            EXPECT_TRUE(pool.waitForDone());
+        }
+    }
+    EXPECT_TRUE(pool.waitForDone());
+
+    for (int i = 0; i < 4; i++) {
+        EXPECT_TRUE(pool.start(std::move(blocking[i])));
+    }
+    while (pool.activeCount() < 4) {
+        PcoThread::usleep(100);
+    }
+    for (int i = 4; i < 4 + 16; i++) {
+        EXPECT_TRUE(pool.start(std::move(blocking[i])));
+    }
+    EXPECT_FALSE(pool.start(std::move(blocking.back())));
+    release = true;
+    EXPECT_TRUE(pool.waitForDone());
+    EXPECT_EQ(nbRun, 200);
+
+    ShutdownResult result = pool.shutdown(ShutdownMode::Drain);
+    EXPECT_EQ(result.drained, 0);
+    EXPECT_EQ(pool.currentNbThreads(), 0);
+}
+
+///
+/// \brief A testcase starting 5000 recycled runnables on a pool of 4 threads
+/// The runnables are started by waves of 50, freed by the workers.
+/// Check is done on the number of objects taken from the global allocator,
+/// bounded by the caches of the threads rather than by the number of runnables.
+///
+TEST_F(ThreadpoolTest, testObjectPool)
+{
+    ObjectPool<RecycledRunnable> &objects = ObjectPool<RecycledRunnable>::instance();
+    size_t createdBefore = objects.created();
+    {
+        ThreadPool pool(4, 100, std::chrono::milliseconds{1000});
+
+        std::atomic<int> nbRun{0};
+        for (int wave = 0; wave < 100; wave++) {
+            for (int i = 0; i < 50; i++) {
+                EXPECT_TRUE(pool.start(std::make_unique<RecycledRunnable>(nbRun)));
+            }
+            EXPECT_TRUE(pool.waitForDone());
+        }
+        EXPECT_EQ(nbRun, 5000);
+    }
+    size_t created = objects.created() - createdBefore;
+    EXPECT_GT(created, 0);
+    // NOTE: every thread keeps less than 2 batches, the producer takes one
+    // more and the workers may each hold one wave
+    EXPECT_LE(created, 5 * 2 * ObjectPool<RecycledRunnable>::batchSize + 4 * 50);
+    // The workers gave their blocks back when they exited
+    EXPECT_GT(objects.available(), 0);
+}
+
+///
+/// \brief A testcase with a pool of 1 thread whose runnables use its arena
+/// Check is done on every runnable getting the same memory back, on the
+/// allocations larger than the arena, on the heap outside of the workers, and
+/// on the runnables of a FixedThreadPool getting the arena of their worker.
+///
+TEST_F(ThreadpoolTest, testArena)
+{
+    EXPECT_EQ(ThreadPool::currentArena(), std::pmr::new_delete_resource());
+
+    ThreadPool pool(1, 100, std::chrono::milliseconds{1000});
+    pool.setArenaSize(64 * 1024);
+
+    std::mutex mutex;
+    std::set<const void *> buffers;
+    std::atomic<size_t> nbBig{0};
+    for (int i = 0; i < 50; i++) {
+        EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("arena", [&] {
+            std::pmr::memory_resource *arena = ThreadPool::currentArena();
+            EXPECT_NE(arena, std::pmr::new_delete_resource());
+            std::pmr::vector<char> small(1000, 'a', arena);
+            std::pmr::vector<char> big(1024 * 1024, 'b', arena);
+            std::lock_guard<std::mutex> lock(mutex);
+            buffers.insert(small.data());
+            nbBig += big.size();
+        })));
+    }
+    EXPECT_TRUE(pool.waitForDone());
+    EXPECT_EQ(buffers.size(), 1);
+    EXPECT_EQ(nbBig, 50 * 1024 * 1024);
+
+    pool.setArenaSize(0);
+    EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("arena", [&] {
+        EXPECT_EQ(ThreadPool::currentArena(), std::pmr::new_delete_resource());
+    })));
+    EXPECT_TRUE(pool.waitForDone());
+
+    FixedThreadPool fixed(2, 10, std::chrono::milliseconds{1000});
+    fixed.setArenaSize(64 * 1024);
+    std::atomic<int> nbArenas{0};
+    for (int i = 0; i < 10; i++) {
+        EXPECT_TRUE(fixed.start(std::make_unique<FunctionRunnable>("arena", [&nbArenas] {
+            if (FixedThreadPool::currentArena() != std::pmr::new_delete_resource()
+                && ThreadPool::currentArena() == FixedThreadPool::currentArena()) {
+                nbArenas++;
+            }
+        })));
+    }
+    EXPECT_TRUE(fixed.waitForDone());
+    EXPECT_EQ(nbArenas, 10);
+}
+
+//! Set by the onStart hook of testWorkerHooks on the worker threads
+static thread_local size_t warmWorker = 0;
+
+///
+/// \brief A testcase with a pool of 4 threads whose hooks warm the workers up
+/// Runs rounds of runnables, each round ending with the workers timing out.
+/// Check is done on every runnable finding its worker warm, and on every
+/// worker started being stopped, on its own thread, by the timer and by the
+/// shutdown.
+///
+TEST_F(ThreadpoolTest, testWorkerHooks)
+{
+    std::atomic<int> nbStarted{0};
+    std::atomic<int> nbStopped{0};
+    WorkerHooks hooks;
+    hooks.onStart = [&nbStarted](size_t id) {
+        warmWorker = id + 1;
+        nbStarted++;
+    };
+    hooks.onStop = [&nbStopped](size_t id) {
+        EXPECT_EQ(warmWorker, id + 1);
+        nbStopped++;
+    };
+
+    auto clock = std::make_shared<ManualClock>();
+    ThreadPool pool(4, 16, std::chrono::milliseconds{1000}, hooks, clock);
+
+    std::atomic<int> nbWarm{0};
+    for (int round = 0; round < 10; round++) {
+        for (int i = 0; i < 8; i++) {
+            EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("hooks", [&nbWarm] {
+                if (warmWorker != 0) {
+                    nbWarm++;
+                }
+            })));
+        }
+        EXPECT_TRUE(pool.waitForDone());
+        size_t nbThreads = pool.currentNbThreads();
+        while (pool.idleCount() < nbThreads) {
+            PcoThread::usleep(100);
+        }
+        clock->waitForSleepers(1);
+        clock->advance(std::chrono::milliseconds{1000});
+        while (pool.currentNbThreads() > 0) {
+            PcoThread::usleep(100);
+        }
+        EXPECT_EQ(nbStopped, nbStarted);
+    }
+    EXPECT_EQ(nbWarm, 80);
+
+    EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("hooks", [] {})));
+    pool.shutdown();
+    EXPECT_GT(nbStarted, 10);
+    EXPECT_EQ(nbStopped, nbStarted);
+
+    nbStarted = 0;
+    nbStopped = 0;
+    {
+        StaticThreadPool<4, 16> fixed(hooks);
+    }
+    EXPECT_EQ(nbStarted, 4);
+    EXPECT_EQ(nbStopped, 4);
+}
+
+///
+/// \brief A testcase reading a fake sysfs with two nodes and a memory only one,
+/// then pinning the workers of a pool of 4 threads to single cores
+/// Check is done on the topology read, on every runnable running on a single
+/// CPU, and on the runnables queued for a node still being cancellable by id.
+///
+TEST_F(ThreadpoolTest, testPlacement)
+{
+    EXPECT_EQ(NumaTopology::parseCpuList("0-3,8,10-11"), (std::vector<int>{0, 1, 2, 3, 8, 10, 11}));
+
+    char root[] = "/tmp/numaXXXXXX";
+    ASSERT_NE(mkdtemp(root), nullptr);
+    auto node = [&root](int id, const std::string &cpulist, const std::string &distance) {
+        std::string dir = std::string(root) + "/node" + std::to_string(id);
+        mkdir(dir.c_str(), 0700);
+        std::ofstream(dir + "/cpulist") << cpulist << std::endl;
+        std::ofstream(dir + "/distance") << distance << std::endl;
+    };
+    node(0, "0-1", "10 30 20");
+    node(1, "", "30 10 20");
+    node(2, "2-3", "20 20 10");
+    NumaTopology topology = NumaTopology::detect(root, {0, 1, 2, 3, 4});
+    EXPECT_EQ(topology.nodeCount(), 2);
+    EXPECT_EQ(topology.cpus(1), (std::vector<int>{2, 3}));
+    EXPECT_EQ(topology.nodeOf(3), 1);
+    EXPECT_EQ(topology.nearest(1), (std::vector<size_t>{1, 0}));
+    EXPECT_EQ(topology.allCpus().size(), 4);
+    topology = NumaTopology::detect(root, {2, 3, 5});
+    EXPECT_EQ(topology.nodeCount(), 1);
+    EXPECT_EQ(topology.cpus(0), (std::vector<int>{2, 3}));
+    topology = NumaTopology::detect(std::string(root) + "/none", {1, 5});
+    EXPECT_EQ(topology.allCpus(), (std::vector<int>{1, 5}));
+    EXPECT_EQ(system(("rm -r " + std::string(root)).c_str()), 0);
+
+    ThreadPool pool(4, 32, std::chrono::milliseconds{100});
+    pool.setPlacement({Pinning::Core, {}});
+    std::atomic<int> nbPinned{0};
+    std::atomic<int> nbCancelled{0};
+    auto pinned = [&nbPinned] {
+        cpu_set_t set;
+        if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) == 1) {
+            nbPinned++;
+        }
+        PcoThread::usleep(1000);
+    };
+    for (int i = 0; i < 16; i++) {
+        EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("pinned", pinned), {}, {}, i));
+    }
+    EXPECT_TRUE(pool.waitForDone());
+    EXPECT_EQ(nbPinned, 16);
+
+    // NOTE: CPU_SETSIZE - 1 is out of the affinity mask of the process
+    nbPinned = 0;
+    pool.setPlacement({Pinning::Core, {CPU_SETSIZE - 1}});
+    for (int i = 0; i < 16; i++) {
+        EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("pinned", pinned)));
+    }
+    EXPECT_TRUE(pool.waitForDone());
+    EXPECT_EQ(nbPinned, 16);
+    EXPECT_EQ(pool.placementFailures(), 0);
+
+    std::atomic<bool> blockerStarted{false};
+    std::atomic<bool> release{false};
+    pool.setPlacement({});
+    for (int i = 0; i < 4; i++) {
+        EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("blocker", [&] {
+            blockerStarted = true;
+            while (!release) {
+                PcoThread::usleep(100);
+            }
+        })));
+    }
+    while (!blockerStarted || pool.activeCount() < 4) {
+        PcoThread::usleep(100);
+    }
+    for (int i = 0; i < 8; i++) {
+        EXPECT_TRUE(pool.start(
+            std::make_unique<FunctionRunnable>(
+                i % 2 ? "kept" : "byId", [] {}, [&nbCancelled] { nbCancelled++; }),
+            {},
+            {},
+            i));
+    }
+    EXPECT_EQ(pool.cancel("byId"), 4);
+    EXPECT_EQ(nbCancelled, 4);
+    release = true;
+    EXPECT_TRUE(pool.waitForDone());
+    EXPECT_EQ(pool.pendingCount(), 0);
+}
+
+//! Returns whether the calling worker is set up as testThreadOptions asks
+static bool checkThreadOptions(const std::string &prefix)
+{
+    char name[16] = {};
+    pthread_getname_np(pthread_self(), name, sizeof(name));
+    pthread_attr_t attr;
+    size_t stackSize = 0;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        pthread_attr_getstacksize(&attr, &stackSize);
+        pthread_attr_destroy(&attr);
+    }
+    return std::string(name).rfind(prefix, 0) == 0 && stackSize >= 256 * 1024
+           && stackSize < 1024 * 1024 && sched_getscheduler(0) == SCHED_BATCH
+           && getpriority(PRIO_PROCESS, gettid()) == 5;
+}
+
+///
+/// \brief A testcase with pools of 4 threads given a name, a small stack, the
+/// batch scheduling class and a nice value
+/// Check is done on every runnable running on a worker set up that way, and on
+/// the threads created afterwards getting the default stack size back.
+///
+TEST_F(ThreadpoolTest, testThreadOptions)
+{
+    ThreadOptions options;
+    options.name = "opts";
+    options.stackSize = 256 * 1024;
+    options.schedClass = SchedClass::Batch;
+    options.nice = 5;
+
+    std::atomic<int> nbChecked{0};
+    {
+        ThreadPool pool(4, 16, std::chrono::milliseconds{100}, options);
+        for (int i = 0; i < 16; i++) {
+            EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("options", [&nbChecked] {
+                if (checkThreadOptions("pool-opts-")) {
+                    nbChecked++;
+                }
+            })));
+        }
+        EXPECT_TRUE(pool.waitForDone());
+        EXPECT_EQ(pool.threadOptionFailures(), 0);
+    }
+    {
+        StaticThreadPool<4, 16> pool(options);
+        for (int i = 0; i < 16; i++) {
+            EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("options", [&nbChecked] {
+                if (checkThreadOptions("pool-opts-")) {
+                    nbChecked++;
+                }
+            })));
+        }
+        EXPECT_TRUE(pool.waitForDone());
+        EXPECT_EQ(pool.threadOptionFailures(), 0);
+    }
+    EXPECT_EQ(nbChecked, 32);
+
+    // NOTE: the pools spawning at once must not leave their stack size behind
+    // nor give it to the workers of a pool left to the default one
+    std::atomic<int> nbSmallStacks{0};
+    {
+        std::vector<std::unique_ptr<ThreadPool>> pools;
+        for (int i = 0; i < 4; i++) {
+            ThreadOptions small;
+            small.stackSize = (i + 1) * 128 * 1024;
+            pools.push_back(std::make_unique<ThreadPool>(4, 16, std::chrono::milliseconds{100}, small));
+        }
+        pools.push_back(std::make_unique<ThreadPool>(4, 16, std::chrono::milliseconds{100}));
+        ThreadPool &defaults = *pools.back();
+        std::vector<std::thread> submitters;
+        for (auto &pool : pools) {
+            submitters.emplace_back([&pool] {
+                for (int i = 0; i < 64; i++) {
+                    pool->start(std::make_unique<FunctionRunnable>("options", [] {}));
+                }
+            });
+        }
+        for (int i = 0; i < 64; i++) {
+            defaults.start(std::make_unique<FunctionRunnable>("options", [&nbSmallStacks] {
+                size_t stackSize = 0;
+                pthread_attr_t attr;
+                pthread_getattr_np(pthread_self(), &attr);
+                pthread_attr_getstacksize(&attr, &stackSize);
+                pthread_attr_destroy(&attr);
+                if (stackSize < 1024 * 1024) {
+                    nbSmallStacks++;
+                }
+            }));
+        }
+        for (auto &submitter : submitters) {
+            submitter.join();
+        }
+        EXPECT_TRUE(defaults.waitForDone());
+    }
+    EXPECT_EQ(nbSmallStacks, 0);
+
+    size_t stackSize = 0;
+    std::thread([&stackSize] {
+        pthread_attr_t attr;
+        pthread_getattr_np(pthread_self(), &attr);
+        pthread_attr_getstacksize(&attr, &stackSize);
+        pthread_attr_destroy(&attr);
+    }).join();
+    EXPECT_GE(stackSize, 1024 * 1024);
+}
+
+///
+/// \brief A testcase queueing 50000 runnables sharing their id and half of
+/// them a group behind a blocker on a pool of 1 thread
+/// Check is done on the group being cancelled and the rest of the queue being
+/// drained in well under the time a scan of the index per dequeue would take.
+///
+TEST_F(ThreadpoolTest, testSameIdDrain)
+{
+    ThreadPool pool(1, 100000, std::chrono::milliseconds{1000});
+    std::atomic<bool> release{false};
+    std::atomic<int> nbRun{0};
+    EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("blocker", [&release] {
+        while (!release) {
+            PcoThread::usleep(100);
+        }
+    })));
+    // NOTE: with several NUMA nodes, the queues aren't FIFO between them
+    while (pool.activeCount() == 0) {
+        PcoThread::usleep(100);
+    }
+    for (int i = 0; i < 50000; i++) {
+        EXPECT_TRUE(pool.start(
+            std::make_unique<FunctionRunnable>("same", [&nbRun] { nbRun++; }),
+            {},
+            i % 2 ? "odd" : ""));
+    }
+    EXPECT_EQ(pool.cancelGroup("odd"), 25000);
+
+    auto begin = std::chrono::steady_clock::now();
+    release = true;
+    EXPECT_TRUE(pool.waitForDone());
+    EXPECT_LT(std::chrono::steady_clock::now() - begin, std::chrono::seconds{2});
+    EXPECT_EQ(nbRun, 25000);
+    EXPECT_EQ(pool.cancel("same"), 0);
+}
+
+/// Whether the given pool cancels runnables by id
+template<typename Pool>
+struct IndexedPool : std::false_type
+{};
+
+template<typename QueuePolicy, typename SyncPolicy, typename GrowthPolicy, typename StatsPolicy>
+struct IndexedPool<BasicThreadPool<QueuePolicy, SyncPolicy, GrowthPolicy, StatsPolicy>>
+    : std::bool_constant<QueuePolicy::indexed>
+{};
+
+/// Cancels a runnable while it runs on the given pool, by id when the queue is
+/// indexed and through its token otherwise, and returns whether the runnable
+/// saw it through ThreadPool::isCancelled().
+template<typename Pool>
+bool checkRunningCancel(Pool &pool)
+{
+    std::atomic<bool> started{false};
+    std::atomic<bool> cancelled{false};
+    CancellationToken token = CancellationToken::create();
+    EXPECT_TRUE(pool.start(
+        std::make_unique<FunctionRunnable>("running", [&] {
+            started = true;
+            for (int i = 0; i < 1000 && !ThreadPool::isCancelled(); i++) {
+                PcoThread::usleep(1000);
+            }
+            cancelled = ThreadPool::isCancelled();
+        }),
+        token));
+    while (!started) {
+        PcoThread::usleep(100);
+    }
+    if constexpr (IndexedPool<Pool>::value) {
+        EXPECT_EQ(pool.cancel("running"), 0);
+    } else {
+        token.cancel();
+    }
+    EXPECT_TRUE(pool.waitForDone());
+    return cancelled;
+}
+
+///
+/// \brief A testcase cancelling a running runnable on pools other than ThreadPool
+/// Check is done on ThreadPool::isCancelled() answering for the runnables of
+/// every instantiation of BasicThreadPool and of StaticThreadPool.
+///
+TEST_F(ThreadpoolTest, testCancelAnyPool)
+{
+    BasicThreadPool<IndexedQueue, MesaSync> mesa(2, 4, std::chrono::milliseconds{100});
+    EXPECT_TRUE(checkRunningCancel(mesa));
+    BasicThreadPool<IndexedQueue, FutexSync> futex(2, 4, std::chrono::milliseconds{100});
+    EXPECT_TRUE(checkRunningCancel(futex));
+    FixedThreadPool fixed(2, 4, std::chrono::milliseconds{100});
+    EXPECT_TRUE(checkRunningCancel(fixed));
+    StaticThreadPool<2, 4> fixedSize;
+    EXPECT_TRUE(checkRunningCancel(fixedSize));
+}
+
+///
+/// \brief A testcase with a pool of 1 thread whose idle timeout is about the
+/// time between two runnables
+/// Check is done on every runnable being run even when started while the only
+/// worker is timing out.
+///
+TEST_F(ThreadpoolTest, testTimeoutRace)
+{
+    ThreadPool pool(1, 10, std::chrono::milliseconds{1});
+    std::atomic<int> nbRun{0};
+    for (int i = 0; i < 500; i++) {
+        EXPECT_TRUE(pool.start(std::make_unique<FunctionRunnable>("race", [&nbRun] { nbRun++; })));
+        ASSERT_TRUE(pool.waitForDone(std::chrono::milliseconds{500}))
+            << "Runnable " << i << " stranded with " << pool.currentNbThreads() << " threads";
+        PcoThread::usleep(900 + i % 200);
+    }
+    EXPECT_EQ(nbRun, 500);
+}
+
+///
+/// \brief A graph of a 200000 nodes long chain, each node also having a leaf,
+/// run on a pool that is shut down
+/// Each chain node makes its leaf and the next chain node ready, the latter
+/// being refused by the pool and run by the thread refusing it.
+/// Check is done on every node being run without running out of stack.
+///
+TEST_F(ThreadpoolTest, testTaskGraphRefusals)
+{
+    constexpr size_t nbLinks = 200000;
+    ThreadPool pool(2, 4, std::chrono::milliseconds{100});
+    pool.shutdown();
+
+    TaskGraph graph;
+    size_t nbRun = 0;
+    TaskGraph::NodeId previous = graph.addNode([&nbRun] { nbRun++; });
+    for (size_t i = 1; i < nbLinks; i++) {
+        TaskGraph::NodeId leaf = graph.addNode([&nbRun] { nbRun++; });
+        TaskGraph::NodeId link = graph.addNode([&nbRun] { nbRun++; });
+        graph.addEdge(previous, leaf);
+        graph.addEdge(previous, link);
+        previous = link;
+    }
+    graph.run(pool);
+    EXPECT_EQ(nbRun, 2 * nbLinks - 1);
+}
+
 
 int main(int argc, char **argv) {
     testing::InitGoogleTest(&argc, argv);